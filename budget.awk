@@ -0,0 +1,57 @@
+# SPDX-License-Identifier: MIT
+#
+# Summarise flash and SRAM use from avr-nm -S -l --size-sort output
+#
+# Symbols at 0x800000 and above are in SRAM; initialised data
+# (type d or D) also occupies flash for its initial values.
+#
+
+function hex(s,    i, v)
+{
+	v = 0
+	s = tolower(s)
+	for (i = 1; i <= length(s); i++)
+		v = v * 16 + index("0123456789abcdef", substr(s, i, 1)) - 1
+	return v
+}
+
+NF >= 4 {
+	addr = hex($1)
+	size = hex($2)
+	file = "(none)"
+	if (NF >= 5) {
+		file = $5
+		sub(/:[0-9]+$/, "", file)
+		sub(/.*\//, "", file)
+	}
+	if (addr >= 8388608) {
+		region = "sram"
+		ram[file] += size
+		ramsum += size
+		if ($3 == "d" || $3 == "D") {
+			flash[file] += size
+			flashsum += size
+		}
+		if (addr + size > ramend)
+			ramend = addr + size
+	} else {
+		region = "flash"
+		flash[file] += size
+		flashsum += size
+	}
+	files[file] = 1
+	printf("%6d  %-5s  %-24s  %s\n", size, region, $4, file)
+}
+
+END {
+	printf("\n%6s  %6s  %s\n", "flash", "sram", "module")
+	for (f in files)
+		printf("%6d  %6d  %s\n", flash[f], ram[f], f)
+	printf("%6d  %6d  total of sized symbols\n", flashsum, ramsum)
+	if (ramend) {
+		ramend -= 8388608
+		floor = ramend > 2048 ? ramend : 2048
+		printf("\nstatic SRAM ends at 0x%03x, ", ramend)
+		printf("stack page headroom %d bytes\n", 2304 - floor)
+	}
+}
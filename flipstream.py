@@ -0,0 +1,274 @@
+# SPDX-License-Identifier: MIT
+
+# Encode image sequences for the flipdot display and play them back
+#
+#   flipstream.py encode [-d] [-t n] [-r fps] clip.gif out.fds
+#   flipstream.py encode frame*.png out.fds
+#   flipstream.py play [-p port] [-b baud] [-l] [-c mode] out.fds
+#
+# Frames are scaled to the 20x5 display and reduced to one bit per
+# pixel by threshold or dither. Each frame is encoded as the shortest
+# of: a fresh line built from font glyphs, raw columns and column
+# offsets, or an edit of the previous frame (optionally shifted)
+# using clear rectangles and raw columns. Every frame ends with LF.
+#
+# Stream file: b'FDS1', then for each frame a little-endian 16 bit
+# display time in ms, a length byte and the encoded bytes.
+#
+# The player uses ack mode and keeps at most 31 unacknowledged bytes
+# queued on the device, so input is never dropped, while holding
+# each frame for at least its display time. The clock setting is
+# stored on the device, so by default the player turns the clock back
+# on when it exits (-c restore); -c off leaves it off and -c keep does
+# not touch it.
+
+import argparse
+import re
+import struct
+import sys
+from time import monotonic, sleep
+
+COLS = 20
+LINES = 5
+PANEL_COLS = 4
+COLMASK = (1 << LINES) - 1
+QUEUE = 31
+MAGIC = b'FDS1'
+FONT = 'include/5x4_ascii.xbm'
+
+
+def load_glyphs(path=FONT):
+    """Return dict of column tuple -> byte for each printable glyph"""
+    with open(path) as f:
+        rows = [int(v, 16) for v in re.findall(r'0x([0-9a-fA-F]{2})',
+                                                 f.read())]
+    glyphs = {}
+    for ch in range(0x21, 0x60):
+        idx = ch - 0x20
+        shift = 0
+        if idx >= 0x20:
+            shift = 4
+            idx -= 0x20
+        cols = [0] * PANEL_COLS
+        for r in range(LINES):
+            bits = rows[idx * LINES + r] >> shift
+            for i in range(PANEL_COLS):
+                cols[i] = (cols[i] << 1) | ((bits >> i) & 1)
+        if any(cols):
+            glyphs.setdefault(tuple(cols), ch)
+    return glyphs
+
+
+def esc(cmd, *args):
+    return b'\x1b' + cmd + bytes(0x30 + a for a in args)
+
+
+def encode_line(frame, glyphs):
+    """Shortest bytes to draw frame into a cleared buffer, with LF"""
+    best = [None] * (COLS + 1)
+    best[COLS] = b''
+    for p in range(COLS - 1, -1, -1):
+        if not any(frame[p:]):
+            best[p] = b''
+            continue
+        opts = []
+        if frame[p] == 0:
+            q = p + 1
+            while frame[q] == 0:
+                q += 1
+            opts.append(bytes([0xc0 | q]) + best[q])
+        else:
+            opts.append(bytes([0x80 | frame[p]]) + best[p + 1])
+            cols = tuple(frame[p:p + PANEL_COLS])
+            cols += (0,) * (PANEL_COLS - len(cols))
+            for g, ch in glyphs.items():
+                if g[:COLS - p] == cols[:COLS - p]:
+                    opts.append(bytes([ch]) + best[min(p + 4, COLS)])
+                    break
+        best[p] = min(opts, key=len)
+    return best[0] + b'\n'
+
+
+def encode_edit(frame, base, prefix):
+    """Bytes to turn buffer base into frame without clearing it"""
+    out = bytearray(prefix)
+    buf = list(base)
+    c = 0
+    while c < COLS:
+        if buf[c] & ~frame[c]:
+            w = 1
+            while c + w < COLS and buf[c + w] & ~frame[c + w]:
+                w += 1
+            out += esc(b'c', c, 0, w, LINES)
+            for i in range(c, c + w):
+                buf[i] = 0
+            c += w
+        else:
+            c += 1
+    if not out:
+        out += esc(b'<', 0)  # mark buffer as drawn, keep contents
+    pos = 0
+    for c in range(COLS):
+        need = frame[c] & ~buf[c]
+        if need:
+            if pos != c:
+                out.append(0xc0 | c)
+            out.append(0x80 | need)
+            pos = c + 1
+    return bytes(out) + b'\n'
+
+
+def encode_frame(frame, prev, glyphs):
+    opts = [encode_line(frame, glyphs)]
+    if prev is not None:
+        opts.append(encode_edit(frame, prev, b''))
+        for k in range(1, PANEL_COLS + 1):
+            left = prev[k:] + [0] * k
+            right = [0] * k + prev[:-k]
+            opts.append(encode_edit(frame, left, esc(b'<', k)))
+            opts.append(encode_edit(frame, right, esc(b'>', k)))
+    return min(opts, key=len)
+
+
+def read_frames(paths, dither, threshold):
+    """Yield (columns, ms) for each frame of the input images"""
+    from PIL import Image, ImageSequence
+    for path in paths:
+        img = Image.open(path)
+        for f in ImageSequence.Iterator(img):
+            ms = f.info.get('duration', 0)
+            g = f.convert('L').resize((COLS, LINES), Image.BOX)
+            if dither:
+                g = g.convert('1')
+            else:
+                g = g.point(lambda v: 255 if v >= threshold else 0, '1')
+            px = g.load()
+            cols = []
+            for x in range(COLS):
+                v = 0
+                for y in range(LINES):
+                    v = (v << 1) | (1 if px[x, y] else 0)
+                cols.append(v)
+            yield cols, ms
+
+
+def encode(args):
+    glyphs = load_glyphs(args.font)
+    prev = None
+    count = total = 0
+    with open(args.output, 'wb') as out:
+        out.write(MAGIC)
+        for cols, ms in read_frames(args.input, args.dither, args.threshold):
+            if args.invert:
+                cols = [c ^ COLMASK for c in cols]
+            if args.rate:
+                ms = int(1000 / args.rate)
+            msg = encode_frame(cols, prev, glyphs)
+            out.write(struct.pack('<HB', min(ms, 0xffff), len(msg)) + msg)
+            prev = cols
+            count += 1
+            total += len(msg)
+    print('%d frames, %d bytes, %.1f bytes/frame' %
+          (count, total, total / max(count, 1)))
+
+
+def read_stream(path):
+    with open(path, 'rb') as f:
+        data = f.read()
+    if data[:4] != MAGIC:
+        sys.exit('%s: not a flipdot stream' % path)
+    frames = []
+    i = 4
+    while i + 3 <= len(data):
+        ms, n = struct.unpack('<HB', data[i:i + 3])
+        frames.append((ms, data[i + 3:i + 3 + n]))
+        i += 3 + n
+    return frames
+
+
+def play(args):
+    import serial
+    frames = read_stream(args.stream)
+    p = serial.Serial(args.port, args.baud, rtscts=False, timeout=0)
+
+    # clock off, let its last update finish, then enter ack mode
+    if args.clock != 'keep':
+        p.write(b'\x13')
+        sleep(3)
+    p.reset_input_buffer()
+    p.write(b'\x0e')
+
+    pending = []  # lengths of frames sent but not acknowledged
+    acks = []  # arrival time of each ack
+    rx = b''
+    due = monotonic()
+    try:
+        while True:
+            for ms, msg in frames:
+                while (sum(pending) + len(msg) > QUEUE
+                       or monotonic() < due):
+                    rx += p.read(64)
+                    while len(rx) >= 2 and pending:
+                        if rx[0] == 0x06:
+                            pending.pop(0)
+                            acks.append(monotonic())
+                            rx = rx[2:]
+                        else:
+                            rx = rx[1:]
+                    sleep(0.005)
+                p.write(msg)
+                pending.append(len(msg))
+                due = max(due + ms / 1000.0, monotonic())
+            if not args.loop:
+                break
+        while pending:
+            rx += p.read(64)
+            while len(rx) >= 2 and pending:
+                if rx[0] == 0x06:
+                    pending.pop(0)
+                    acks.append(monotonic())
+                    rx = rx[2:]
+                else:
+                    rx = rx[1:]
+            sleep(0.005)
+    finally:
+        # leave ack mode, and turn the stored clock setting back on
+        p.write(b'\x0f')
+        if args.clock == 'restore':
+            p.write(b'\x11')
+        p.flush()
+    if len(acks) > 1:
+        print('%d frames, %.0f ms per frame' %
+              (len(acks), 1000 * (acks[-1] - acks[0]) / (len(acks) - 1)))
+
+
+def main():
+    ap = argparse.ArgumentParser(description='flipdot stream tool')
+    sub = ap.add_subparsers(dest='cmd', required=True)
+    e = sub.add_parser('encode', help='encode images to stream file')
+    e.add_argument('input', nargs='+', help='image files or animation')
+    e.add_argument('output', help='stream file to write')
+    e.add_argument('-d', '--dither', action='store_true',
+                   help='dither instead of threshold')
+    e.add_argument('-t', '--threshold', type=int, default=128)
+    e.add_argument('-i', '--invert', action='store_true')
+    e.add_argument('-r', '--rate', type=float,
+                   help='frames per second, overrides image timing')
+    e.add_argument('-f', '--font', default=FONT)
+    e.set_defaults(func=encode)
+    p = sub.add_parser('play', help='play stream file to display')
+    p.add_argument('stream')
+    p.add_argument('-p', '--port', default='/dev/ttyUSB0')
+    p.add_argument('-b', '--baud', type=int, default=9600)
+    p.add_argument('-l', '--loop', action='store_true')
+    p.add_argument('-c', '--clock', choices=('restore', 'off', 'keep'),
+                   default='restore',
+                   help='turn the clock back on at exit (default), '
+                   'leave it off, or never touch it')
+    p.set_defaults(func=play)
+    args = ap.parse_args()
+    args.func(args)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,54 @@
+// SPDX-License-Identifier: MIT
+
+/*
+ * Wear-levelled EEPROM storage for settings, panel pixels and the
+ * background layer
+ */
+#ifndef CONFIG_H
+#define CONFIG_H
+#include <stdint.h>
+#include "display.h"
+
+/* persistent settings record, one per EEPROM slot */
+struct config_stat {
+	uint8_t	seq;			/* record sequence number */
+	uint8_t	magic;			/* marks a written record */
+	uint8_t	clock;			/* clock status flags */
+	uint8_t	colpower;		/* columns powered during sweep */
+	uint8_t	baud;			/* serial baud rate index */
+	uint8_t	addr;			/* bus address or CONFIG_NOADDR */
+	uint8_t	link;			/* bus topology flags */
+	uint8_t	order;			/* sweep column order */
+	uint8_t	effect;			/* frame transition effect */
+	uint8_t	back[DISPLAY_FRAMELEN];		/* background layer */
+	uint8_t	panel[DISPLAY_FRAMELEN];	/* last panel pixels */
+	uint8_t	sum;			/* checksum over preceding bytes */
+};
+
+/* addr value for unaddressed operation */
+#define CONFIG_NOADDR	0x4f
+
+/* link flag: controllers are daisy-chained, forward all input */
+#define CONFIG_CHAIN	0
+
+/* link flag: last controller of a daisy chain, TX reaches the host */
+#define CONFIG_LAST	1
+
+/* working copy of settings */
+extern struct config_stat config;
+
+/* Load newest valid record into config, return 0 if none found */
+uint8_t config_load(void);
+
+/* Schedule changed settings to be written, once no further save has
+ * been requested for a short hold time */
+void config_save(void);
+
+/* Schedule a changed background layer to be written, at most once per
+ * CONFIG_FRAMEGAP ticks after the previous record */
+void config_save_frame(void);
+
+/* Advance pending EEPROM writes by at most one byte */
+void config_tick(void);
+
+#endif /* CONFIG_H */
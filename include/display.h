@@ -11,15 +11,20 @@
  * Display layout (viewed from front side)
  *
  *       Display is an integer number of panel groups, each 8 columns wide
- *       by 5 rows high, stored as unsigned 8 bit integers:
+ *       by 5 rows high. Pixel buffers store one unsigned 8 bit integer
+ *       per column, top line in bit 4, bottom line in bit 0:
  *       +--------+-------
- *       |XXXXXXXX|       
- *       |XXXXXXXX|       
- *       |XXXXXXXX| [...] 
- *       |XXXXXXXX|       
- *       |XXXXXXXX|       
+ *       |44444444|       
+ *       |33333333|       
+ *       |22222222| [...] 
+ *       |11111111|       
+ *       |00000000|       
  *       +--------+-------
  *
+ *       Saved frames are packed in rows (CAIRO_FORMAT_A1), each panel
+ *       group stored as one unsigned 8 bit integer per line, leftmost
+ *       column in bit 0.
+ *
  *       Display panels form a shift register that chains 2 display
  *       panels per group, left to right:
  *       +---+---+---
@@ -47,11 +52,11 @@
  *       sent serially as a string of 8 bit messages (one per row):
  * Bit:	    7   6   5   4   3   2   1   0
  * Byte	 +-------------------------------+
- *    0	 |S17 C17 S18 C18 S19 C19 S20 C20|
- *    1	 |S13 C13 S14 C14 S15 C15 S16 C16|
- *    2	 | S9  C9 S10 C10 S11 C11 S12 C12|
- *    3	 | S5  C5  S6  C6  S7  C7  S8  C8|
- *    4	 | S1  C1  S2  C2  S3  C3  S4  C4|
+ *    0	 |C17 S17 C18 S18 C19 S19 C20 S20|
+ *    1	 |C13 S13 C14 S14 C15 S15 C16 S16|
+ *    2	 | C9  S9 C10 S10 C11 S11 C12 S12|
+ *    3	 | C5  S5  C6  S6  C7  S7  C8  S8|
+ *    4	 | C1  S1  C2  S2  C3  S3  C4  S4|
  *	 +-------------------------------+
  *
  *       The whole display is updated by shifting out panel updates from
@@ -63,7 +68,9 @@
 #define PANEL_LINES	5
 
 /* number of 4x5 panels in display */
+#ifndef DISPLAY_PANELS
 #define DISPLAY_PANELS	5
+#endif
 
 /* number of 8bit panel groups ceil(DISPLAY_PANELS/2) */
 #define DISPLAY_GROUPS	((DISPLAY_PANELS + 1) / 2)
@@ -84,13 +91,49 @@
 #define DISPLAY_PPG	(DISPLAY_GROUPCOLS / PANEL_COLS)
 
 /* size of display pixel buffers */
-#define DISPLAY_BUFLEN	(DISPLAY_WIDTH * DISPLAY_LINES)
+#define DISPLAY_BUFLEN	DISPLAY_COLS
+
+/* valid pixel bits in a buffer column */
+#define DISPLAY_COLMASK	((1U << DISPLAY_LINES) - 1U)
 
 /* number of 8 bit (row) messages in panel update request string */
 #define DISPLAY_REQLEN	(DISPLAY_PANELS * DISPLAY_LINES)
 
+/* size of packed frame used to save and restore display contents */
+#define DISPLAY_FRAMELEN	(DISPLAY_GROUPS * DISPLAY_LINES)
+
+/* during update sweep, keep this many columns powered at a time */
+#define DISPLAY_COLPOWER 10
+
+/* column order of update sweep */
+#define DISPLAY_LTR		0	/* left to right */
+#define DISPLAY_RTL		1	/* right to left */
+#define DISPLAY_CENTRE		2	/* centre outwards */
+#define DISPLAY_INTERLEAVE	3	/* one column per panel in turn */
+#define DISPLAY_DISSOLVE	4	/* pseudo-random */
+#define DISPLAY_ORDERS		5
+
+/* transition from displayed to new frame */
+#define DISPLAY_CUT		0	/* sweep new frame directly */
+#define DISPLAY_WIPE		1	/* sweep to blank, then new frame */
+#define DISPLAY_PUSH		2	/* scroll new frame in from right */
+#define DISPLAY_EFFECTS		3
+
+/* framebuffer layers, composited in order with later layers on top */
+#define DISPLAY_BACKGROUND	0	/* host text and graphics */
+#define DISPLAY_CLOCK		1	/* internal clock and messages */
+#define DISPLAY_ALERT		2	/* host overlay */
+#define DISPLAY_LAYERS		3
+
+/* layer modes, see display_show() */
+#define DISPLAY_HIDE		0	/* not composited */
+#define DISPLAY_OPAQUE		1	/* replaces lower layers in region */
+#define DISPLAY_OVERLAY		2	/* set pixels drawn over lower layers */
+#define DISPLAY_MODES		3
+
 /* status flag register */
 #define DISPLAY_STAT GPIOR0
+#define DISDONE 3
 #define DISABRT 4
 #define DISFSH 5
 #define DISUPD 6
@@ -98,34 +141,77 @@
 
 /* display and panel update request data structures */
 struct display_stat {
-	uint8_t		buf[DISPLAY_BUFLEN];	/* CAIRO_FORMAT_A1 */
+	uint8_t		buf[DISPLAY_BUFLEN];	/* one byte per column */
 	uint8_t		cur[DISPLAY_BUFLEN];
 	uint8_t		req[DISPLAY_REQLEN];
+	uint8_t		next[DISPLAY_BUFLEN];	/* target of transition */
+	uint8_t		order[DISPLAY_COLS];	/* columns in sweep order */
+	uint8_t		layer[DISPLAY_LAYERS][DISPLAY_BUFLEN];
+	uint8_t		first[DISPLAY_LAYERS];	/* first column of region */
+	uint8_t		width[DISPLAY_LAYERS];	/* columns in region */
+	uint8_t		shown;			/* enabled layer flags */
+	uint8_t		overlay;		/* transparent layer flags */
+	uint8_t		*draw;			/* layer written by draw calls */
 };
 
+/* display buffers and request */
+extern struct display_stat display;
+
 /* Convenience macros to set flags */
 #define display_trigger() do { GPIOR0 |= _BV(DISUPD) ; } while(0)
 #define display_flush() do { GPIOR0 |= _BV(DISFSH) ; } while(0)
 #define display_abort() do { GPIOR0 |= _BV(DISABRT) ; } while(0)
 
-/* Clear the display buffer */
+/* Clear the selected layer */
 void display_clear(void);
 
-/* Fill display buffer with ch */
+/* Fill the selected layer with ch */
 void display_fill(uint8_t ch);
 
 /* Un-power all pixel coils */
 void display_relax(void);
 
-/* Advance display updates */
+/* Start pending display update, call from main loop once per tick */
 void display_tick(void);
 
+/* Latch prepared sweep request and prepare the next, call from the
+ * Timer0 interrupt on each system tick */
+void display_step(void);
+
 /* Place character at column */
 void display_char(uint8_t ch, uint8_t col);
 
 /* Place column of raw data */
 void display_data(uint8_t data, uint8_t col);
 
+/* Set number of columns powered at a time during sweep */
+void display_power(uint8_t cols);
+
+/* Direct drawing calls to layer */
+void display_select(uint8_t layer);
+
+/* Hide layer or show it opaque or as overlay */
+void display_show(uint8_t layer, uint8_t mode);
+
+/* Limit layer to w columns from column x */
+void display_region(uint8_t layer, uint8_t x, uint8_t w);
+
+/* Set column order of update sweeps */
+void display_order(uint8_t order);
+
+/* Set transition effect between frames */
+void display_effect(uint8_t effect);
+
+/* Copy panel pixels and background layer into packed frames */
+void display_save(uint8_t * panel, uint8_t * back);
+
+/* Load packed frames into panel state and background layer without
+ * flipping pixels */
+void display_restore(uint8_t * panel, uint8_t * back);
+
+/* Return CRC-16/CCITT of the DISPLAY_COLS columns in buf */
+uint16_t display_crc(uint8_t * buf);
+
 /* Initialise display and relax all coils */
 void display_init(void);
 
@@ -8,12 +8,26 @@
 #include <stdint.h>
 
 struct ds3231_stat {
+	uint8_t	second;
 	uint8_t	minute;
 	uint8_t	hour;
 	int8_t	temp;
 };
 
-/* Read current values into structure and clear alarm flag */
+/* Count of I2C transactions since reset */
+extern uint16_t ds3231_xfers;
+
+/* Count of transactions abandoned on bus timeout */
+extern uint8_t ds3231_timeouts;
+
+/* Count of transactions refused or not acknowledged */
+extern uint8_t ds3231_errors;
+
+/* Count of bus recoveries that left SDA held low */
+extern uint8_t ds3231_stuck;
+
+/* Read current values into structure and clear alarm flag,
+ * return 0 if the RTC could not be read */
 uint8_t ds3231_read(struct ds3231_stat *stat);
 
 /* Clear SDA and prepare TWI peripheral */
@@ -25,6 +39,9 @@ void ds3231_seconds(uint8_t seconds);
 /* set RTC minutes */
 void ds3231_minutes(uint8_t minutes);
 
+/* set RTC seconds and minutes in a single transaction */
+void ds3231_time(uint8_t seconds, uint8_t minutes);
+
 /* set RTC hours */
 void ds3231_hours(uint8_t hours);
 
@@ -0,0 +1,37 @@
+// SPDX-License-Identifier: MIT
+
+/*
+ * Column-wise drawing operations on the display buffer
+ */
+#ifndef GFX_H
+#define GFX_H
+#include <stdint.h>
+
+/* rectangle operations */
+#define GFX_SET	0
+#define GFX_CLR	1
+#define GFX_XOR	2
+
+/* stored sprites */
+#define GFX_SPRITES	4
+#define GFX_SPRITELEN	8
+
+/* Return column mask for h lines from line y (top line is 0) */
+uint8_t gfx_lines(uint8_t y, uint8_t h);
+
+/* Apply op with line mask to w columns from column x */
+void gfx_rect(uint8_t x, uint8_t w, uint8_t mask, uint8_t op);
+
+/* Move buffer n columns left, blanking or rolling around the end */
+void gfx_left(uint8_t n, uint8_t roll);
+
+/* Move buffer n columns right, blanking or rolling around the end */
+void gfx_right(uint8_t n, uint8_t roll);
+
+/* Store w columns from column x into sprite s */
+void gfx_grab(uint8_t s, uint8_t x, uint8_t w);
+
+/* Copy sprite s into buffer at column x */
+void gfx_blit(uint8_t s, uint8_t x);
+
+#endif /* GFX_H */
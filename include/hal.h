@@ -0,0 +1,100 @@
+// SPDX-License-Identifier: MIT
+
+/*
+ * Hardware abstraction for peripherals with side effects
+ *
+ * Status registers (GPIOR0-2, port inputs, UART receive) are used
+ * directly by the firmware. Peripheral access that triggers hardware
+ * actions goes through the functions below: src/hal_avr.c for the
+ * m328p, src/hal_host.c for the native host build.
+ */
+#ifndef HAL_H
+#define HAL_H
+#include <stdint.h>
+
+#ifdef __AVR__
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+#else
+#include "hal_host.h"
+#endif
+
+/* System tick period in cycles at F_CPU (2 MHz) */
+#define HAL_TICK_CYCLES ((uint32_t) 50176U)
+
+/* System tick counter, Timer0 compare B is unused */
+#define SYSTICK OCR0B
+
+/* Start Timer0 system tick */
+void hal_timer_init(void);
+
+/* Called from Timer0 ISR, return non-zero on system tick */
+uint8_t hal_tick(void);
+
+/*
+ * Run CPU at 16 MHz if fast is non-zero, else F_CPU, rescaling timer,
+ * serial, TWI and SPI dividers. Return non-zero if the clock was
+ * changed, or zero if already set, the serial transmitter is busy or
+ * the RX line is low. The caller makes sure no byte is arriving.
+ */
+uint8_t hal_clock(uint8_t fast);
+
+/* Restart the current system tick period */
+void hal_timer_sync(void);
+
+/* Return time since last system tick, 0-195 in units of 256 cycles */
+uint8_t hal_timer_count(void);
+
+/* Sleep until the next interrupt has been handled */
+void hal_sleep(void);
+
+/* Init 8n1 serial I/O w/ U2X0 and interrupt receive */
+void hal_uart_init(uint8_t ubrr);
+
+/* Write byte to serial output, also called from the RX interrupt */
+void hal_uart_send(uint8_t ch);
+
+/* Init SPI output to display */
+void hal_spi_init(void);
+
+/* Send byte to display via SPI */
+void hal_spi_send(uint8_t val);
+
+/* Latch display request register to coils */
+void hal_spi_latch(void);
+
+/* TWI status returned when the bus does not respond in time */
+#define HAL_TWI_TIMEOUT	0x01
+
+/* Clear SDA and prepare TWI peripheral */
+void hal_twi_init(void);
+
+/* Clock SCL until SDA is released, return 0 if the bus is free */
+uint8_t hal_twi_recover(void);
+
+/* Send start condition, return TWI status */
+uint8_t hal_twi_start(void);
+
+/* Send byte, return TWI status */
+uint8_t hal_twi_write(uint8_t ch);
+
+/* Receive byte into ch with ack if ack is non-zero, return TWI status */
+uint8_t hal_twi_read(uint8_t * ch, uint8_t ack);
+
+/* Send stop condition */
+void hal_twi_stop(void);
+
+/* Read EEPROM byte */
+uint8_t hal_eeprom_read(uint16_t addr);
+
+/* Start EEPROM write of val if it differs from stored value */
+void hal_eeprom_write(uint16_t addr, uint8_t val);
+
+/* Return non-zero if EEPROM is ready for a write */
+uint8_t hal_eeprom_ready(void);
+
+/* Return count of stack bytes never used since reset */
+uint16_t hal_stack_free(void);
+
+#endif /* HAL_H */
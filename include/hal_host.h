@@ -0,0 +1,46 @@
+// SPDX-License-Identifier: MIT
+
+/*
+ * Native host build register and avr-libc substitutes
+ *
+ * Registers used directly by the firmware are plain variables,
+ * updated by the simulation in src/hal_host.c before it calls the
+ * interrupt handlers.
+ */
+#ifndef HAL_HOST_H
+#define HAL_HOST_H
+#include <stdint.h>
+
+extern volatile uint8_t GPIOR0;
+extern volatile uint8_t GPIOR1;
+extern volatile uint8_t GPIOR2;
+extern volatile uint8_t OCR0B;
+extern volatile uint8_t UCSR0A;
+extern volatile uint8_t UDR0;
+extern volatile uint8_t PIND;
+extern volatile uint8_t PORTD;
+extern volatile uint8_t PINC;
+
+/* UCSR0A flags */
+#define DOR0	3
+#define FE0	4
+
+/* Size of simulated EEPROM */
+#define E2END	0x3ff
+
+#define _BV(bit) (1U << (bit))
+#define bit_is_set(sfr, bit) ((sfr) & _BV(bit))
+#define bit_is_clear(sfr, bit) (!((sfr) & _BV(bit)))
+#define loop_until_bit_is_set(sfr, bit) do { } while (bit_is_clear(sfr, bit))
+
+/* Interrupts are only delivered from hal_sleep, so blocks are atomic */
+#define ATOMIC_FORCEON 0
+#define ATOMIC_BLOCK(type) for (uint8_t _once = 1; _once; _once = 0)
+#define sei() do { } while (0)
+
+/* Interrupt handlers are called from hal_sleep */
+#define ISR(vect) void vect(void)
+void TIMER0_COMPA_vect(void);
+void USART_RX_vect(void);
+
+#endif /* HAL_HOST_H */
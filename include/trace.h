@@ -0,0 +1,37 @@
+// SPDX-License-Identifier: MIT
+
+/*
+ * Capture of latched display requests for sweep timing analysis
+ */
+#ifndef TRACE_H
+#define TRACE_H
+#include <stdint.h>
+#include "display.h"
+
+/* number of entries in trace ring, power of 2 */
+#define TRACE_LEN	32
+#define TRACE_MASK	(TRACE_LEN - 1)
+
+/* digest of one latched request */
+struct trace_entry {
+	uint8_t	tick;			/* SYSTICK at latch */
+	uint8_t	count;			/* timer count within tick */
+	uint8_t	cols[DISPLAY_GROUPS];	/* columns with powered coils */
+	uint8_t	coils;			/* number of powered coils */
+};
+
+/* least and greatest timer count at latch since trace_enable() */
+extern uint8_t trace_minlat;
+extern uint8_t trace_maxlat;
+
+/* Clear ring and start capture if on is non-zero, else stop */
+void trace_enable(uint8_t on);
+
+/* Record request if capture is on, called when request is latched
+ * from the Timer0 interrupt */
+void trace_latch(uint8_t * req);
+
+/* Remove oldest entry into e, return 0 if ring is empty */
+uint8_t trace_read(struct trace_entry *e);
+
+#endif /* TRACE_H */
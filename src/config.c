@@ -0,0 +1,165 @@
+// SPDX-License-Identifier: MIT
+
+/*
+ * Wear-levelled EEPROM storage for settings, panel pixels and the
+ * background layer
+ *
+ * EEPROM is divided into fixed size slots, and each new record is
+ * written to the slot after the newest one with an incremented
+ * sequence number. A record is written one byte per tick, checksum
+ * last, so an interrupted write leaves the previous record intact.
+ *
+ * A settings change is held until no further change has arrived for
+ * CONFIG_HOLD ticks. A changed frame is written at most once every
+ * CONFIG_FRAMEGAP ticks, and only if the background layer differs:
+ * the panel image is stored with each record but never causes one,
+ * so the clock alone does not wear the EEPROM.
+ */
+
+#include <stddef.h>
+#include "hal.h"
+#include "config.h"
+
+#define CONFIG_MAGIC	0x5a
+#define CONFIG_LEN	((uint8_t) sizeof(struct config_stat))
+#define CONFIG_SLOTLEN	64U
+#define CONFIG_SLOTS	((uint8_t) ((E2END + 1U) / CONFIG_SLOTLEN))
+#define CONFIG_HOLD	40U	/* quiet ticks before a save, 1 s */
+#define CONFIG_FRAMEGAP	2400U	/* ticks between frame saves, 1 min */
+
+/* bytes compared to decide whether a record is needed */
+#define CONFIG_DIFFLEN	((uint8_t) offsetof(struct config_stat, panel))
+
+/* a record must fit its slot, the frames grow with DISPLAY_PANELS */
+typedef char config_fits_slot[sizeof(struct config_stat) <= CONFIG_SLOTLEN
+			      ? 1 : -1];
+
+struct config_stat config;
+
+/* most recently stored record, and write progress */
+struct config_stat stored;
+uint8_t wrslot;
+uint8_t wroft = CONFIG_LEN;
+uint8_t pending;		/* ticks until requested save, 0 if none */
+uint8_t framepend;		/* frame save requested */
+uint16_t age = CONFIG_FRAMEGAP;	/* ticks since last record, saturating */
+
+/* return EEPROM address of slot */
+uint16_t config_addr(uint8_t slot)
+{
+	return (uint16_t) (slot * CONFIG_SLOTLEN);
+}
+
+/* read record from slot */
+void config_read(struct config_stat *rec, uint8_t slot)
+{
+	uint8_t *dst = (uint8_t *) rec;
+	uint16_t addr = config_addr(slot);
+	uint8_t i = 0U;
+	do {
+		dst[i] = hal_eeprom_read(addr + i);
+		i++;
+	} while (i < CONFIG_LEN);
+}
+
+/* return checksum over all record bytes preceding sum */
+uint8_t config_sum(struct config_stat *rec)
+{
+	uint8_t *src = (uint8_t *) rec;
+	uint8_t sum = 0U;
+	uint8_t i = 0U;
+	do {
+		sum = (uint8_t) (sum + src[i]);
+		i++;
+	} while (i < CONFIG_LEN - 1U);
+	return (uint8_t) ~ sum;
+}
+
+/* return non-zero if records differ in more than the panel image */
+uint8_t config_diff(struct config_stat *a, struct config_stat *b)
+{
+	uint8_t *pa = (uint8_t *) a;
+	uint8_t *pb = (uint8_t *) b;
+	uint8_t i = 0U;
+	do {
+		if (pa[i] != pb[i]) {
+			return 1U;
+		}
+		i++;
+	} while (i < CONFIG_DIFFLEN);
+	return 0U;
+}
+
+uint8_t config_load(void)
+{
+	struct config_stat rec;
+	uint8_t found = 0U;
+	uint8_t slot = 0U;
+	do {
+		config_read(&rec, slot);
+		if (rec.magic == CONFIG_MAGIC && rec.sum == config_sum(&rec)) {
+			if (!found || (int8_t) (rec.seq - stored.seq) > 0) {
+				stored = rec;
+				wrslot = slot;
+				found = 1U;
+			}
+		}
+		slot++;
+	} while (slot < CONFIG_SLOTS);
+	if (found) {
+		config = stored;
+	} else {
+		wrslot = CONFIG_SLOTS - 1U;
+	}
+	return found;
+}
+
+void config_save(void)
+{
+	pending = CONFIG_HOLD;
+}
+
+void config_save_frame(void)
+{
+	framepend = 1U;
+}
+
+/* start writing config to the next slot if it differs from the
+ * stored record */
+void config_store(void)
+{
+	framepend = 0U;
+	config.seq = stored.seq;
+	config.magic = CONFIG_MAGIC;
+	if (config_diff(&config, &stored)) {
+		config.seq++;
+		config.sum = config_sum(&config);
+		stored = config;
+		wrslot++;
+		if (wrslot >= CONFIG_SLOTS) {
+			wrslot = 0U;
+		}
+		wroft = 0U;
+		age = 0U;
+	}
+}
+
+void config_tick(void)
+{
+	if (age < CONFIG_FRAMEGAP) {
+		age++;
+	}
+	if (wroft < CONFIG_LEN) {
+		if (hal_eeprom_ready()) {
+			hal_eeprom_write(config_addr(wrslot) + wroft,
+					 ((uint8_t *) & stored)[wroft]);
+			wroft++;
+		}
+	} else if (pending) {
+		if (--pending == 0U) {
+			config_store();
+		}
+	} else if (framepend && age >= CONFIG_FRAMEGAP) {
+		config_store();
+	}
+}
@@ -5,20 +5,29 @@
  */
 
 #include "display.h"
-#include <avr/io.h>
+#include "hal.h"
 #include "util.h"
 #include "font.h"
+#include "trace.h"
 
 #define DISPLAY_BPP	5
-#define SPI_CS		2
-#define SPI_COPI	3
-#define SPI_SCK		5
 
-/* during update sweep, keep this many columns powered at a time */
-#define DISPLAY_COLPOWER 10
-#define DISPLAY_COLOVER (DISPLAY_COLS + DISPLAY_COLPOWER)
+#define DISPLAY_COLOVER (nsweep + colpower)
+
+/* sweep step after the final relax request */
+#define SWEEP_DONE	0xffU
+
+/* Galois LFSR taps for a maximal 8 bit sequence */
+#define DISPLAY_LFSR	0xb8U
 
 struct display_stat display;
+uint8_t colpower = DISPLAY_COLPOWER;
+uint8_t sweep;			/* column order of sweep */
+uint8_t effect;			/* transition effect */
+uint8_t phase;			/* transition frame, 0 when idle */
+uint8_t lfsr = 1U;		/* dissolve sequence state */
+uint8_t nsweep;			/* changed columns in sweep order */
+uint8_t ck;			/* sweep step of prepared request */
 
 /* fetch the byte offset in request for the provided group, panel and line */
 uint8_t req_offset(uint8_t group, uint8_t panel, uint8_t line)
@@ -29,19 +38,12 @@ uint8_t req_offset(uint8_t group, uint8_t panel, uint8_t line)
 	return (uint8_t) (poft * DISPLAY_BPP + loft);
 }
 
-/* Send byte to display via SPI */
-void shift_byte(uint8_t val)
-{
-	SPDR = val;
-	loop_until_bit_is_set(SPSR, SPIF);
-}
-
 /* send current request buffer to display */
 void req_send(void)
 {
 	uint8_t cnt = 0;
 	do {
-		shift_byte(display.req[cnt]);
+		hal_spi_send(display.req[cnt]);
 		cnt++;
 	} while (cnt < DISPLAY_REQLEN);
 }
@@ -49,56 +51,32 @@ void req_send(void)
 /* latch display request register to coils */
 void req_latch(void)
 {
-	PORTB |= _BV(SPI_CS);
-	PORTB &= (uint8_t) ~ _BV(SPI_CS);
+	hal_spi_latch();
+	trace_latch(display.req);
 }
 
-/* return an 8 bit set/clear pattern for the bottom 4 bits of val */
-uint8_t setclr_pattern(uint8_t val, uint8_t mask)
-{
-	uint8_t cnt = 0x0U;
-	uint8_t ret = 0x0U;
-	do {
-		ret = (uint8_t) (ret << 2);
-		if (mask & 0x08) {
-			if (val & 0x08)
-				ret |= 0x1;
-			else
-				ret |= 0x2;
-		}
-		mask = (uint8_t) (mask << 1);
-		val = (uint8_t) (val << 1);
-		cnt++;
-	} while (cnt < 4);
-	return (uint8_t) ret;
-}
-
-/* write group column updates to request */
+/* write column updates to request */
 void update_column(uint8_t col)
 {
-	uint8_t goft = col >> 3;	/* group offset */
-	uint8_t coft = col & 0x7U;	/* column offset in group */
-	uint8_t poft = coft >> 2;	/* panel offset in group */
-	uint8_t shift = col & 0x4U;	/* src shift for panel data */
-	uint8_t srcmask = (uint8_t) (0x1U << coft);
-	uint8_t srcoft;
-	uint8_t src;
-	uint8_t roft;
-	uint8_t mask;
+	uint8_t shift = (uint8_t) ((col & 0x3U) << 1);	/* coil offset */
+	uint8_t src = display.buf[col];
+	uint8_t mask = (uint8_t) (src ^ display.cur[col]);
+	uint8_t roft =
+	    req_offset(col >> 3, (col >> 2) & 0x1U, DISPLAY_LINES - 1U);
 	uint8_t line = 0U;
+	display.cur[col] = src;
 	do {
-		srcoft = (uint8_t) (line * DISPLAY_GROUPS + goft);
-		src = display.buf[srcoft];
-		mask = srcmask & (src ^ display.cur[srcoft]);
-		roft = req_offset(goft, poft, line);
-		display.req[roft] |=
-		    setclr_pattern((uint8_t) (src >> shift),
-				   (uint8_t) (mask >> shift));
-		display.cur[srcoft] &= (uint8_t) (~srcmask);
-		display.cur[srcoft] |= src & srcmask;
+		if (mask & 0x1U) {
+			if (src & 0x1U)
+				display.req[roft] |= (uint8_t) (0x1U << shift);
+			else
+				display.req[roft] |= (uint8_t) (0x2U << shift);
+		}
+		mask = mask >> 1;
+		src = src >> 1;
+		roft++;
 		line++;
 	} while (line < DISPLAY_LINES);
-
 }
 
 /* transfer a single column of changes from buf into req */
@@ -163,46 +141,216 @@ void display_relax(void)
 	req_latch();
 }
 
-/* animate changes onto display as required */
-void display_tick(void)
+/* composite shown layers into buf, later layers on top: an opaque
+ * layer replaces lower ones in its region, an overlay adds its set
+ * pixels and lets lower layers show through elsewhere */
+void display_compose(void)
+{
+	uint8_t l = 0U;
+	uint8_t col = 0U;
+	uint8_t end;
+	do {
+		display.buf[col] = 0U;
+		col++;
+	} while (col < DISPLAY_BUFLEN);
+	do {
+		if (display.shown & _BV(l)) {
+			col = display.first[l];
+			end = (uint8_t) (col + display.width[l]);
+			while (col < end && col < DISPLAY_COLS) {
+				if (display.overlay & _BV(l))
+					display.buf[col] |= display.layer[l][col];
+				else
+					display.buf[col] = display.layer[l][col];
+				col++;
+			}
+		}
+		l++;
+	} while (l < DISPLAY_LAYERS);
+}
+
+/* fill sweep order for the next update with changed columns only */
+void sweep_start(void)
+{
+	uint8_t k = 0U;
+	uint8_t n = 0U;
+	uint8_t col;
+	uint8_t mid = DISPLAY_COLS / 2U;
+	do {
+		switch (sweep) {
+		case DISPLAY_RTL:
+			display.order[k] = (uint8_t) (DISPLAY_COLS - 1U - k);
+			break;
+		case DISPLAY_CENTRE:
+			if (k & 0x1U)
+				display.order[k] = (uint8_t) (mid - 1U - (k >> 1));
+			else
+				display.order[k] = (uint8_t) (mid + (k >> 1));
+			break;
+		case DISPLAY_INTERLEAVE:
+			display.order[k] =
+			    (uint8_t) ((k % DISPLAY_PANELS) * PANEL_COLS
+				       + k / DISPLAY_PANELS);
+			break;
+		case DISPLAY_DISSOLVE:
+			/* next value of 1..DISPLAY_COLS from the LFSR, the
+			 * sequence continues so each sweep starts elsewhere */
+			do {
+				if (lfsr & 0x1U)
+					lfsr = (uint8_t) ((lfsr >> 1) ^
+							  DISPLAY_LFSR);
+				else
+					lfsr = lfsr >> 1;
+			} while (lfsr > DISPLAY_COLS);
+			display.order[k] = (uint8_t) (lfsr - 1U);
+			break;
+		default:
+			display.order[k] = k;
+			break;
+		}
+		k++;
+	} while (k < DISPLAY_COLS);
+
+	/* skip columns that already show buf */
+	k = 0U;
+	do {
+		col = display.order[k];
+		if (display.buf[col] != display.cur[col]) {
+			display.order[n] = col;
+			n++;
+		}
+		k++;
+	} while (k < DISPLAY_COLS);
+	nsweep = n;
+}
+
+/* return column at step of sweep, or DISPLAY_COLS past the end */
+uint8_t sweep_col(uint8_t step)
+{
+	if (step < nsweep) {
+		return display.order[step];
+	}
+	return DISPLAY_COLS;
+}
+
+/* load the next transition frame into buf, return 0 when complete */
+uint8_t transition_frame(void)
+{
+	uint8_t i = 0U;
+	uint8_t src;
+	if (phase == 0U) {
+		/* new update: keep target and start from displayed frame */
+		do {
+			display.next[i] = display.buf[i];
+			display.buf[i] = display.cur[i];
+			i++;
+		} while (i < DISPLAY_BUFLEN);
+		i = 0U;
+	}
+	phase++;
+	if (effect == DISPLAY_WIPE && phase == 1U) {
+		do {
+			display.buf[i] = 0U;
+			i++;
+		} while (i < DISPLAY_BUFLEN);
+	} else if (effect == DISPLAY_WIPE && phase == 2U) {
+		do {
+			display.buf[i] = display.next[i];
+			i++;
+		} while (i < DISPLAY_BUFLEN);
+	} else if (effect == DISPLAY_PUSH
+		   && phase <= DISPLAY_COLS / PANEL_COLS) {
+		/* move one panel left and feed in next panel of target */
+		src = (uint8_t) ((phase - 1U) * PANEL_COLS);
+		do {
+			if (i + PANEL_COLS < DISPLAY_COLS)
+				display.buf[i] = display.buf[i + PANEL_COLS];
+			else
+				display.buf[i] = display.next[src++];
+			i++;
+		} while (i < DISPLAY_BUFLEN);
+	} else {
+		phase = 0U;
+	}
+	return phase;
+}
+
+/* compute request for the next sweep step and shift it out, the
+ * panels keep their coils until the request is latched */
+void sweep_next(void)
+{
+	if (ck > DISPLAY_COLOVER || bit_is_set(DISPLAY_STAT, DISABRT)) {
+		req_relax();
+		ck = SWEEP_DONE;
+	} else {
+		req_power_col(sweep_col(ck));
+		if (ck >= colpower)
+			req_relax_col(sweep_col((uint8_t) (ck - colpower)));
+		ck++;
+	}
+	req_send();
+}
+
+/* latch prepared request, then prepare the next one */
+void display_step(void)
 {
-	static uint8_t ck = 0U;
 	if (bit_is_set(DISPLAY_STAT, DISBSY)) {
-		if (ck > DISPLAY_COLOVER || bit_is_set(DISPLAY_STAT, DISABRT)) {
-			req_relax();
+		req_latch();
+		if (ck == SWEEP_DONE) {
 			if (bit_is_set(DISPLAY_STAT, DISABRT)) {
-				display_clear();
+				phase = 0U;
+			}
+			if (phase && transition_frame()) {
+				/* sweep next frame of transition */
+				DISPLAY_STAT = (uint8_t) (_BV(DISUPD)
+					| (DISPLAY_STAT & _BV(DISDONE)));
+			} else {
+				DISPLAY_STAT = _BV(DISDONE);
 			}
-			DISPLAY_STAT = 0U;
 		} else {
-			req_power_col(ck);
-			if (ck >= DISPLAY_COLPOWER)
-				req_relax_col((uint8_t)
-					      (ck - DISPLAY_COLPOWER));
+			sweep_next();
 		}
-		req_send();
-		req_latch();
-		ck++;
-	} else {
-		if (bit_is_set(DISPLAY_STAT, DISUPD)) {
-			if (bit_is_set(DISPLAY_STAT, DISFSH))
-				display_invalidate();
-			DISPLAY_STAT = _BV(DISBSY);
-			ck = 0U;
+	}
+}
+
+/* start a pending display update */
+void display_tick(void)
+{
+	if (bit_is_set(DISPLAY_STAT, DISUPD)
+	    && bit_is_clear(DISPLAY_STAT, DISBSY)) {
+		if (phase == 0U) {
+			display_compose();
+			if (effect != DISPLAY_CUT)
+				transition_frame();
 		}
+		if (bit_is_set(DISPLAY_STAT, DISFSH))
+			display_invalidate();
+		sweep_start();
+		ck = 0U;
+		sweep_next();
+		barrier();
+		/* a completed update may not have been handled yet */
+		DISPLAY_STAT = (uint8_t) (_BV(DISBSY)
+					  | (DISPLAY_STAT & _BV(DISDONE)));
 	}
 }
 
 /* initialise h/w & buffer, relax all coils */
 void display_init(void)
 {
+	uint8_t l;
+
 	/* Init SPI output */
-	DDRB = _BV(SPI_COPI) | _BV(SPI_SCK) | _BV(SPI_CS);
-	PORTB &= (uint8_t) ~ _BV(SPI_CS);
-	SPCR = _BV(SPE) | _BV(DORD) | _BV(MSTR);
-	SPSR |= _BV(SPI2X);
+	hal_spi_init();
 
-	/* clear buffers and relax coils */
+	/* background layer fills the display, clear buffers and relax */
+	display.draw = display.layer[DISPLAY_BACKGROUND];
+	l = 0U;
+	do {
+		display.width[l] = DISPLAY_COLS;
+		l++;
+	} while (l < DISPLAY_LAYERS);
+	display.shown = _BV(DISPLAY_BACKGROUND);
 	display_clear();
 	display_relax();
 }
@@ -211,94 +359,211 @@ void display_init(void)
 void display_fill(uint8_t ch)
 {
 	uint8_t i = 0;
+	ch &= DISPLAY_COLMASK;
 	do {
-		display.buf[i] = ch;
+		display.draw[i] = ch;
 		i++;
 	} while (i < DISPLAY_BUFLEN);
 }
 
+/* Set number of columns powered at a time during sweep */
+void display_power(uint8_t cols)
+{
+	if (cols == 0U) {
+		cols = 1U;
+	} else if (cols > DISPLAY_COLS) {
+		cols = DISPLAY_COLS;
+	}
+	colpower = cols;
+}
+
+/* Direct drawing calls to layer */
+void display_select(uint8_t layer)
+{
+	if (layer < DISPLAY_LAYERS) {
+		display.draw = display.layer[layer];
+	}
+}
+
+/* Hide layer or show it opaque or as overlay */
+void display_show(uint8_t layer, uint8_t mode)
+{
+	if (layer < DISPLAY_LAYERS && mode < DISPLAY_MODES) {
+		display.shown &= (uint8_t) ~ _BV(layer);
+		display.overlay &= (uint8_t) ~ _BV(layer);
+		if (mode != DISPLAY_HIDE) {
+			display.shown |= (uint8_t) _BV(layer);
+		}
+		if (mode == DISPLAY_OVERLAY) {
+			display.overlay |= (uint8_t) _BV(layer);
+		}
+	}
+}
+
+/* Limit layer to w columns from column x */
+void display_region(uint8_t layer, uint8_t x, uint8_t w)
+{
+	if (layer < DISPLAY_LAYERS) {
+		display.first[layer] = x;
+		display.width[layer] = w;
+	}
+}
+
+/* Set column order of update sweeps */
+void display_order(uint8_t order)
+{
+	if (order < DISPLAY_ORDERS) {
+		sweep = order;
+	}
+}
+
+/* Set transition effect between frames */
+void display_effect(uint8_t fx)
+{
+	if (fx < DISPLAY_EFFECTS) {
+		effect = fx;
+	}
+}
+
+/* Pack columns into an A1 frame, as stored by earlier versions */
+void frame_pack(uint8_t * frame, uint8_t * src)
+{
+	uint8_t i = 0;
+	do {
+		frame[i] = 0U;
+		i++;
+	} while (i < DISPLAY_FRAMELEN);
+	uint8_t col = 0;
+	uint8_t line;
+	uint8_t val;
+	do {
+		val = src[col];
+		line = DISPLAY_LINES - 1U;
+		do {
+			if (val & 0x1U)
+				frame[line * DISPLAY_GROUPS + (col >> 3)] |=
+				    (uint8_t) (1U << (col & 0x7U));
+			val = val >> 1;
+			line--;
+		} while (line < DISPLAY_LINES);
+		col++;
+	} while (col < DISPLAY_COLS);
+}
+
+/* Unpack an A1 frame into columns */
+void frame_unpack(uint8_t * frame, uint8_t * dst)
+{
+	uint8_t col = 0;
+	uint8_t line;
+	uint8_t val;
+	do {
+		val = 0U;
+		line = 0U;
+		do {
+			val = (uint8_t) (val << 1);
+			if (frame[line * DISPLAY_GROUPS + (col >> 3)] &
+			    (1U << (col & 0x7U)))
+				val |= 0x1U;
+			line++;
+		} while (line < DISPLAY_LINES);
+		dst[col] = val;
+		col++;
+	} while (col < DISPLAY_COLS);
+}
+
+/* Copy panel pixels and background layer into packed frames */
+void display_save(uint8_t * panel, uint8_t * back)
+{
+	frame_pack(panel, display.cur);
+	frame_pack(back, display.layer[DISPLAY_BACKGROUND]);
+}
+
+/* Load packed frames into panel state and background layer without
+ * flipping pixels, other layers are redrawn by their owners */
+void display_restore(uint8_t * panel, uint8_t * back)
+{
+	frame_unpack(panel, display.cur);
+	frame_unpack(panel, display.buf);
+	frame_unpack(back, display.layer[DISPLAY_BACKGROUND]);
+}
+
+/* Return CRC-16/CCITT (0x1021, initial 0xffff) over pixel buffer */
+uint16_t display_crc(uint8_t * buf)
+{
+	uint16_t crc = 0xffffU;
+	uint8_t col = 0;
+	uint8_t bit;
+	do {
+		crc ^= (uint16_t) (buf[col] << 8);
+		bit = 8U;
+		do {
+			if (crc & 0x8000U)
+				crc = (uint16_t) ((crc << 1) ^ 0x1021U);
+			else
+				crc = (uint16_t) (crc << 1);
+			bit--;
+		} while (bit);
+		col++;
+	} while (col < DISPLAY_COLS);
+	return crc;
+}
+
 /* Draw raw data at column */
 void display_data(uint8_t data, uint8_t col)
 {
-	uint8_t group;
-	uint8_t mask = (uint8_t) (1U << (col & 0x7));
-	data &= 0x1f;
-	uint8_t poft;
-	uint8_t row;
 	if (col < DISPLAY_COLS) {
-		group = col >> 3U;
-		row = 4U;
-		do {
-			poft = (uint8_t) (group + row * DISPLAY_GROUPS);
-			if (data & 0x1)
-				display.buf[poft] |= mask;
-			data = data >> 1U;
-			row--;
-		} while (row < DISPLAY_LINES);
+		display.draw[col] |= data & DISPLAY_COLMASK;
 	}
 }
 
 /* Draw character at column */
 void display_char(uint8_t ch, uint8_t col)
 {
-	uint8_t oft;
+	uint8_t glyph[PANEL_COLS];
 	uint8_t cshift;
-	uint8_t mask;
-	uint8_t group;
-	uint8_t pshift;
 	uint8_t row;
 	uint8_t tmp;
-	uint8_t poft;
 	uint8_t foft;
+	uint8_t i;
 
 	if (col < DISPLAY_COLS) {
-		oft = 0U;
 		if (ch >= 0x20 && ch < 0x80) {
 			if (ch & 0x40)
 				ch &= 0x5f;
 			ch = (uint8_t) (ch - 0x20);
 			if (ch >= 0x20) {
-				mask = 0xf0;
 				cshift = 4U;
 				ch = (uint8_t) (ch - 0x20);
 			} else {
-				mask = 0x0f;
 				cshift = 0;
 			}
-			oft = (uint8_t) (FONT_5X4_CHARH * ch);
-			/* first part */
-			group = col >> 3U;
-			pshift = col & 0x7;
+			foft = (uint8_t) (FONT_5X4_CHARH * ch);
+			/* transpose font rows into columns */
+			i = 0;
+			do {
+				glyph[i] = 0U;
+				i++;
+			} while (i < PANEL_COLS);
 			row = 0;
 			do {
-				poft = (uint8_t) (group + row * DISPLAY_GROUPS);
-				foft = (uint8_t) (oft + row);
-				tmp =
-				    (uint8_t) ((Font_5x4[foft] & mask) >>
-					       cshift);
-				display.buf[poft] =
-				    (uint8_t) (display.buf[poft] | tmp <<
-					       pshift);
+				tmp = (uint8_t) (Font_5x4[foft] >> cshift);
+				i = 0;
+				do {
+					glyph[i] = (uint8_t) (glyph[i] << 1);
+					if (tmp & 0x1U)
+						glyph[i] |= 0x1U;
+					tmp = tmp >> 1;
+					i++;
+				} while (i < PANEL_COLS);
+				foft++;
 				row++;
 			} while (row < DISPLAY_LINES);
-			/* remainder */
-			if (pshift >= 4) {
-				group++;
-				cshift =
-				    (uint8_t) (cshift + (4 - (pshift - 4)));
-				row = 0;
-				do {
-					poft =
-					    (uint8_t) (group +
-						       row * DISPLAY_GROUPS);
-					foft = (uint8_t) (oft + row);
-					tmp = (uint8_t) ((Font_5x4[foft] & mask)
-							 >> cshift);
-					display.buf[poft] =
-					    (uint8_t) (display.buf[poft] | tmp);
-					row++;
-				} while (row < DISPLAY_LINES);
-			}
+			i = 0;
+			do {
+				display.draw[col] |= glyph[i];
+				col++;
+				i++;
+			} while (i < PANEL_COLS && col < DISPLAY_COLS);
 		}
 	}
 }
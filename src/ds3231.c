@@ -4,114 +4,116 @@
  * Minimal blocking TWI Master interface to DS 3231 RTC on
  * Jaycar XC9044 module with /INT conected to PORTC.3
  *
- * Note: Minimal error checking aborts failed transactions
+ * Every bus wait is bounded: a transaction that times out is
+ * abandoned and the bus is clocked free, so the worst case cost of
+ * a call is a few TWI byte timeouts. Failures are counted and the
+ * caller keeps its last known time.
  */
 
-#include <avr/io.h>
+#include "hal.h"
 #include "ds3231.h"
 
-#define SLA_W 0xd0;
-#define SLA_R 0xd1;
+#define SLA_W 0xd0
+#define SLA_R 0xd1
 
-void i2c_start(void)
-{
-	TWCR = _BV(TWINT) | _BV(TWSTA) | _BV(TWEN);
-	loop_until_bit_is_set(TWCR, TWINT);
-}
-
-void i2c_slaw(void)
-{
-	TWDR = SLA_W;
-	TWCR = _BV(TWINT) | _BV(TWEN);
-	loop_until_bit_is_set(TWCR, TWINT);
-}
-
-void i2c_slar(void)
-{
-	TWDR = SLA_R;
-	TWCR = _BV(TWINT) | _BV(TWEN);
-	loop_until_bit_is_set(TWCR, TWINT);
-}
-
-/* send data byte */
-void i2c_data(uint8_t ch)
-{
-	TWDR = ch;
-	TWCR = _BV(TWINT) | _BV(TWEN);
-	loop_until_bit_is_set(TWCR, TWINT);
-}
+uint16_t ds3231_xfers;
+uint8_t ds3231_timeouts;
+uint8_t ds3231_errors;
+uint8_t ds3231_stuck;
 
-/* recv data byte with ack */
-uint8_t i2c_dack(void)
+/* record a failed transaction and return non-zero */
+uint8_t i2c_fail(uint8_t status)
 {
-	TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWEA);
-	loop_until_bit_is_set(TWCR, TWINT);
-	return TWDR;
+	if (status == HAL_TWI_TIMEOUT) {
+		++ds3231_timeouts;
+		if (hal_twi_recover()) {
+			++ds3231_stuck;
+		}
+	} else {
+		++ds3231_errors;
+	}
+	return 1U;
 }
 
-/* recv data byte with nack */
-uint8_t i2c_dnack(void)
+/* send start condition and return status */
+uint8_t i2c_start(void)
 {
-	TWCR = _BV(TWINT) | _BV(TWEN);
-	loop_until_bit_is_set(TWCR, TWINT);
-	return TWDR;
+	++ds3231_xfers;
+	return hal_twi_start();
 }
 
 /* send i2c stop */
 void i2c_stop(void)
 {
-	TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWSTO);
+	hal_twi_stop();
 }
 
-/* send len bytes from buf to slave addr */
-void i2c_send(uint8_t addr, uint8_t * buf, uint8_t len)
+/* send len bytes from buf to slave addr, return 0 on success */
+uint8_t i2c_send(uint8_t addr, uint8_t * buf, uint8_t len)
 {
-	i2c_start();
-	if ((TWSR & 0xf8) == 0x08) {
-		i2c_slaw();
-		if ((TWSR & 0xf8) == 0x18) {
-			i2c_data(addr);
-			while (len) {
-				i2c_data(*buf++);
+	uint8_t status = i2c_start();
+	if (status == 0x08) {
+		status = hal_twi_write(SLA_W);
+		if (status == 0x18) {
+			status = hal_twi_write(addr);
+			while (len && status == 0x28) {
+				status = hal_twi_write(*buf++);
 				--len;
 			}
 		}
 	}
+	if (status == HAL_TWI_TIMEOUT) {
+		return i2c_fail(status);
+	}
 	i2c_stop();
+	if (status != 0x28) {
+		return i2c_fail(status);
+	}
+	return 0U;
 }
 
-/* read len bytes into buf */
-void i2c_recv(uint8_t * buf, uint8_t len)
+/* read len bytes into buf, return 0 on success */
+uint8_t i2c_recv(uint8_t * buf, uint8_t len)
 {
-	i2c_start();
-	if ((TWSR & 0xf8) == 0x08) {
-		i2c_slar();
-		if ((TWSR & 0xf8) == 0x40) {
-			while (len > 1) {
-				*buf++ = i2c_dack();
+	uint8_t status = i2c_start();
+	if (status == 0x08) {
+		status = hal_twi_write(SLA_R);
+		if (status == 0x40) {
+			while (len > 1 && status != HAL_TWI_TIMEOUT) {
+				status = hal_twi_read(buf++, 1U);
 				--len;
 			}
-			if (len) {
-				*buf++ = i2c_dnack();
+			if (len && status != HAL_TWI_TIMEOUT) {
+				status = hal_twi_read(buf++, 0U);
 			}
 		}
 	}
+	if (status == HAL_TWI_TIMEOUT) {
+		return i2c_fail(status);
+	}
 	i2c_stop();
+	if (status != 0x58) {
+		return i2c_fail(status);
+	}
+	return 0U;
 }
 
 uint8_t ds3231_read(struct ds3231_stat *stat)
 {
 	uint8_t cmd[7];
 	cmd[0] = 0x00;
-	i2c_send(0x0f, &cmd[0], 1);
-	i2c_recv(&cmd[0], 7);
+	if (i2c_send(0x0f, &cmd[0], 1) || i2c_recv(&cmd[0], 7)) {
+		cmd[6] = 0U;
+	}
 	if (cmd[6]) {
 		stat->hour = cmd[5];
 		stat->minute = cmd[4];
+		stat->second = cmd[3];
 		stat->temp = (int8_t) cmd[1];
 	} else {
 		stat->hour = 0x1f;
 		stat->minute = 0xff;
+		stat->second = 0xff;
 		stat->temp = 0;
 	}
 	return cmd[6];
@@ -132,20 +134,21 @@ void ds3231_seconds(uint8_t seconds)
 	i2c_send(0x00, &seconds, 1U);
 }
 
+void ds3231_time(uint8_t seconds, uint8_t minutes)
+{
+	uint8_t cmd[2];
+	cmd[0] = seconds;
+	cmd[1] = minutes;
+	i2c_send(0x00, &cmd[0], 2U);
+}
+
 void ds3231_init(void)
 {
 	uint8_t cmd[5];
 	struct ds3231_stat stat;
 
-	/* Clear I2C state, ref: ds3231 datasheet */
-	PORTC = _BV(3);		// Pull up /INT input
-	DDRC = _BV(5);
-	do {
-		PINC |= _BV(5);
-	} while (bit_is_clear(PINC, 4));
-
-	/* re-configure Port C */
-	DDRC = 0;
+	/* Clear I2C state */
+	hal_twi_init();
 
 	/* initialise RTC and Alarm 2 Mask bits for "once per minute"  */
 	cmd[0] = 0x80;		// A2M2
@@ -0,0 +1,108 @@
+// SPDX-License-Identifier: MIT
+
+/*
+ * Column-wise drawing operations on the selected display layer
+ *
+ * Each buffer byte holds a whole column, so every operation
+ * touches one byte per column regardless of the lines affected.
+ */
+
+#include "display.h"
+#include "gfx.h"
+
+struct gfx_sprite {
+	uint8_t	width;
+	uint8_t	cols[GFX_SPRITELEN];
+};
+
+struct gfx_sprite sprites[GFX_SPRITES];
+
+uint8_t gfx_lines(uint8_t y, uint8_t h)
+{
+	if (y >= DISPLAY_LINES) {
+		return 0U;
+	}
+	if (h > DISPLAY_LINES - y) {
+		h = (uint8_t) (DISPLAY_LINES - y);
+	}
+	return (uint8_t) (((1U << h) - 1U) << (DISPLAY_LINES - y - h));
+}
+
+void gfx_rect(uint8_t x, uint8_t w, uint8_t mask, uint8_t op)
+{
+	while (w && x < DISPLAY_COLS) {
+		if (op == GFX_SET) {
+			display.draw[x] |= mask;
+		} else if (op == GFX_CLR) {
+			display.draw[x] &= (uint8_t) ~ mask;
+		} else {
+			display.draw[x] ^= mask;
+		}
+		x++;
+		w--;
+	}
+}
+
+void gfx_left(uint8_t n, uint8_t roll)
+{
+	uint8_t carry;
+	uint8_t i;
+	while (n) {
+		carry = roll ? display.draw[0] : 0U;
+		i = 0;
+		do {
+			display.draw[i] = display.draw[i + 1U];
+			i++;
+		} while (i < DISPLAY_COLS - 1U);
+		display.draw[DISPLAY_COLS - 1U] = carry;
+		n--;
+	}
+}
+
+void gfx_right(uint8_t n, uint8_t roll)
+{
+	uint8_t carry;
+	uint8_t i;
+	while (n) {
+		carry = roll ? display.draw[DISPLAY_COLS - 1U] : 0U;
+		i = DISPLAY_COLS - 1U;
+		do {
+			display.draw[i] = display.draw[i - 1U];
+			i--;
+		} while (i);
+		display.draw[0] = carry;
+		n--;
+	}
+}
+
+void gfx_grab(uint8_t s, uint8_t x, uint8_t w)
+{
+	uint8_t i = 0;
+	if (s < GFX_SPRITES) {
+		if (w > GFX_SPRITELEN) {
+			w = GFX_SPRITELEN;
+		}
+		while (i < w) {
+			if (x < DISPLAY_COLS) {
+				sprites[s].cols[i] = display.draw[x];
+			} else {
+				sprites[s].cols[i] = 0U;
+			}
+			x++;
+			i++;
+		}
+		sprites[s].width = w;
+	}
+}
+
+void gfx_blit(uint8_t s, uint8_t x)
+{
+	uint8_t i = 0;
+	if (s < GFX_SPRITES) {
+		while (i < sprites[s].width && x < DISPLAY_COLS) {
+			display.draw[x] = sprites[s].cols[i];
+			x++;
+			i++;
+		}
+	}
+}
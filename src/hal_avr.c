@@ -0,0 +1,304 @@
+// SPDX-License-Identifier: MIT
+
+/*
+ * m328p (Nano) peripheral access
+ */
+
+#include <avr/sleep.h>
+#include <avr/eeprom.h>
+#include <avr/power.h>
+#include <util/delay.h>
+#include "hal.h"
+
+#define SPI_CS		2	// PORTB.2
+#define SPI_COPI	3	// PORTB.3
+#define SPI_SCK		5	// PORTB.5
+#define TWI_SDA		4	// PORTC.4
+#define TWI_SCL		5	// PORTC.5
+#define RTC_INT		3	// PORTC.3
+#define UART_RXD	0	// PORTD.0
+
+/* Timer0 compare value: 196 counts of clk/256 at 2 MHz, 2 x 196
+ * counts of clk/1024 at 16 MHz */
+#define TICK_OCR	195
+
+/* Timer0 counts at F_CPU in each of the two periods per tick at 16 MHz */
+#define TICK_HALF	((TICK_OCR + 1U) / 2U)
+
+/* TWI bit rate divisor for 400 kHz SCL at 16 MHz */
+#define TWBR_FAST	12
+
+/* Polls of TWINT before a TWI operation is abandoned: about 3 ms
+ * at 2 MHz, well over one byte time at either SCL rate */
+#define TWI_POLLS	1000U
+
+/* SCL edges for bus recovery: nine clocks release any slave */
+#define TWI_RECOVER	18U
+
+/* SCL half period for bus recovery: 5 us at 16 MHz, _delay_us()
+ * counts at F_CPU so the wait is longer at the idle clock */
+#define TWI_HALFBIT	(5.0 * 16000000.0 / F_CPU)
+
+/* Unused stack is painted with STACK_PAINT at reset. With
+ * -mtiny-stack only SPL changes, so the stack cannot grow
+ * below the 256 byte page holding RAMEND. */
+#define STACK_PAINT	0xc5
+#define STACK_FLOOR	(RAMEND & 0xff00)
+
+extern uint8_t __heap_start;	/* end of static RAM, from linker */
+
+uint8_t clkfast;		/* non-zero when running at 16 MHz */
+uint8_t tickphase;		/* Timer0 postscaler at 16 MHz */
+uint8_t txused;			/* serial transmitter has been used */
+uint8_t ubrr_base;		/* UBRR0 at F_CPU */
+
+void hal_timer_init(void)
+{
+	OCR0A = TICK_OCR;
+	TCCR0A = _BV(WGM01);
+	TCCR0B = _BV(CS02);
+	TIMSK0 |= _BV(OCIE0A);
+}
+
+void hal_timer_sync(void)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		TCNT0 = 0U;
+		tickphase = 1U;	/* first of two periods at 16 MHz */
+	}
+}
+
+uint8_t hal_timer_count(void)
+{
+	uint8_t count = TCNT0;
+	if (clkfast) {
+		/* two Timer0 periods per tick, second has tickphase clear */
+		count = (uint8_t) (count >> 1);
+		if (!tickphase) {
+			count = (uint8_t) (count + TICK_HALF);
+		}
+	}
+	return count;
+}
+
+uint8_t hal_tick(void)
+{
+	if (clkfast) {
+		tickphase ^= 0x1U;
+		return tickphase;
+	}
+	return 1U;
+}
+
+uint8_t hal_clock(uint8_t fast)
+{
+	if (fast == clkfast) {
+		return 0U;
+	}
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		if (txused && bit_is_clear(UCSR0A, TXC0)) {
+			return 0U;
+		}
+		/* a start bit or unread byte: the receiver is not idle */
+		if (bit_is_clear(PIND, UART_RXD) || bit_is_set(UCSR0A, RXC0)) {
+			return 0U;
+		}
+		/* keep the position within the current tick */
+		uint8_t count = hal_timer_count();
+		if (fast) {
+			clock_prescale_set(clock_div_1);
+			TCCR0B = _BV(CS02) | _BV(CS00);
+			tickphase = 1U;
+			if (count >= TICK_HALF) {
+				count = (uint8_t) (count - TICK_HALF);
+				tickphase = 0U;
+			}
+			TCNT0 = (uint8_t) (count << 1);
+			UBRR0 = (uint16_t) (((ubrr_base + 1U) << 3) - 1U);
+			TWBR = TWBR_FAST;
+			SPSR &= (uint8_t) ~ _BV(SPI2X);
+			SPCR |= _BV(SPR0);
+		} else {
+			clock_prescale_set(clock_div_8);
+			TCCR0B = _BV(CS02);
+			TCNT0 = count;
+			UBRR0 = ubrr_base;
+			TWBR = 0U;
+			SPCR &= (uint8_t) ~ _BV(SPR0);
+			SPSR |= _BV(SPI2X);
+		}
+		clkfast = fast;
+	}
+	return 1U;
+}
+
+void hal_sleep(void)
+{
+	sleep_mode();
+}
+
+void hal_uart_init(uint8_t ubrr)
+{
+	ubrr_base = ubrr;
+	UCSR0A = _BV(U2X0);
+	UBRR0 = ubrr;
+	UCSR0B = _BV(RXCIE0) | _BV(RXEN0) | _BV(TXEN0);
+	UCSR0C = _BV(UCSZ01) | _BV(UCSZ00);
+}
+
+void hal_uart_send(uint8_t ch)
+{
+	uint8_t sent = 0U;
+	do {
+		loop_until_bit_is_set(UCSR0A, UDRE0);
+		/* the RX interrupt may send a byte in between */
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			if (bit_is_set(UCSR0A, UDRE0)) {
+				UCSR0A = _BV(U2X0) | _BV(TXC0);	// Clear transmit complete
+				UDR0 = ch;
+				txused = 1U;
+				sent = 1U;
+			}
+		}
+	} while (!sent);
+}
+
+void hal_spi_init(void)
+{
+	DDRB = _BV(SPI_COPI) | _BV(SPI_SCK) | _BV(SPI_CS);
+	PORTB &= (uint8_t) ~ _BV(SPI_CS);
+	SPCR = _BV(SPE) | _BV(DORD) | _BV(MSTR);
+	SPSR |= _BV(SPI2X);
+}
+
+void hal_spi_send(uint8_t val)
+{
+	SPDR = val;
+	loop_until_bit_is_set(SPSR, SPIF);
+}
+
+void hal_spi_latch(void)
+{
+	PORTB |= _BV(SPI_CS);
+	PORTB &= (uint8_t) ~ _BV(SPI_CS);
+}
+
+/* wait a bounded time for TWINT and return TWI status */
+uint8_t twi_wait(void)
+{
+	uint16_t polls = TWI_POLLS;
+	do {
+		if (bit_is_set(TWCR, TWINT)) {
+			return TWSR & 0xf8;
+		}
+		polls--;
+	} while (polls);
+
+	/* release the bus, next start re-enables TWI */
+	TWCR = 0U;
+	return HAL_TWI_TIMEOUT;
+}
+
+void hal_twi_init(void)
+{
+	PORTC = _BV(RTC_INT);	// Pull up /INT input
+	hal_twi_recover();
+}
+
+uint8_t hal_twi_recover(void)
+{
+	/* Clear I2C state, ref: ds3231 datasheet. Lines are driven
+	 * low through DDRC and released to the pull-ups. */
+	uint8_t edges = TWI_RECOVER;
+	TWCR = 0U;
+	PORTC &= (uint8_t) ~ (_BV(TWI_SCL) | _BV(TWI_SDA));
+	DDRC = 0U;
+	while (bit_is_clear(PINC, TWI_SDA) && edges) {
+		DDRC ^= _BV(TWI_SCL);
+		_delay_us(TWI_HALFBIT);
+		edges--;
+	}
+
+	/* STOP: take SDA low while SCL is low, release SCL then SDA */
+	DDRC = _BV(TWI_SCL);
+	_delay_us(TWI_HALFBIT);
+	DDRC = _BV(TWI_SCL) | _BV(TWI_SDA);
+	_delay_us(TWI_HALFBIT);
+	DDRC = _BV(TWI_SDA);
+	_delay_us(TWI_HALFBIT);
+
+	/* re-configure Port C, next start re-enables TWI */
+	DDRC = 0U;
+	_delay_us(TWI_HALFBIT);
+	return (uint8_t) bit_is_clear(PINC, TWI_SDA);
+}
+
+uint8_t hal_twi_start(void)
+{
+	TWCR = _BV(TWINT) | _BV(TWSTA) | _BV(TWEN);
+	return twi_wait();
+}
+
+uint8_t hal_twi_write(uint8_t ch)
+{
+	TWDR = ch;
+	TWCR = _BV(TWINT) | _BV(TWEN);
+	return twi_wait();
+}
+
+uint8_t hal_twi_read(uint8_t * ch, uint8_t ack)
+{
+	uint8_t status;
+	if (ack) {
+		TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWEA);
+	} else {
+		TWCR = _BV(TWINT) | _BV(TWEN);
+	}
+	status = twi_wait();
+	*ch = TWDR;
+	return status;
+}
+
+void hal_twi_stop(void)
+{
+	TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWSTO);
+}
+
+uint8_t hal_eeprom_read(uint16_t addr)
+{
+	return eeprom_read_byte((uint8_t *) (uintptr_t) addr);
+}
+
+void hal_eeprom_write(uint16_t addr, uint8_t val)
+{
+	eeprom_update_byte((uint8_t *) (uintptr_t) addr, val);
+}
+
+uint8_t hal_eeprom_ready(void)
+{
+	return (uint8_t) eeprom_is_ready();
+}
+
+/* Paint free RAM up to the stack before .data and .bss are set */
+void hal_stack_paint(void) __attribute__((naked, used, section(".init3")));
+void hal_stack_paint(void)
+{
+	uint8_t *p = &__heap_start;
+	while (p < (uint8_t *) (uintptr_t) SP) {
+		*p++ = STACK_PAINT;
+	}
+}
+
+uint16_t hal_stack_free(void)
+{
+	uint8_t *p = &__heap_start;
+	uint16_t count = 0;
+	if (p < (uint8_t *) STACK_FLOOR) {
+		p = (uint8_t *) STACK_FLOOR;
+	}
+	while (p <= (uint8_t *) RAMEND && *p == STACK_PAINT) {
+		p++;
+		count++;
+	}
+	return count;
+}
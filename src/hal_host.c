@@ -0,0 +1,562 @@
+// SPDX-License-Identifier: MIT
+
+/*
+ * Native host build: serial port on a pseudo-terminal, flipdot
+ * panels rendered to the terminal and a simulated DS3231 RTC
+ *
+ * Usage: avr-flipdrv-host [link]
+ *
+ * The pty slave name is printed on stderr, and optionally symlinked
+ * to link. EEPROM contents followed by the panel pixels, which keep
+ * their state across resets like real flipdots, are kept in the file
+ * named by FLIPDRV_STATE (default avr-flipdrv-host.sim).
+ *
+ * With FLIPDRV_CHECK set, each request latched during a sweep is
+ * decoded against the pixel-level panel model below and compared
+ * with the firmware's idea of the panels (display.cur): a driven
+ * coil must move its pixel to the value in cur, set and clear must
+ * never be driven together, and once no coil is powered the panel
+ * pixels must equal cur. Failures are reported on stderr.
+ */
+#define _DEFAULT_SOURCE
+#define _XOPEN_SOURCE 700
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include "hal.h"
+#include "display.h"
+
+#define SIM_SDA 4		// PORTC.4
+#define SIM_RTCINT 3		// PORTC.3
+#define SIM_STATE "avr-flipdrv-host.sim"
+#define SIM_TICK_COUNTS 196	// Timer0 counts per tick, as hal_avr.c
+
+/* Registers used directly by the firmware */
+volatile uint8_t GPIOR0;
+volatile uint8_t GPIOR1;
+volatile uint8_t GPIOR2;
+volatile uint8_t OCR0B;
+volatile uint8_t UCSR0A;
+volatile uint8_t UDR0;
+volatile uint8_t PIND = 0xff;
+volatile uint8_t PORTD;
+volatile uint8_t PINC = 0xff;
+
+/* Firmware entry point, renamed by the host build */
+void firmware_main(void);
+
+/* serial port */
+int ptyfd = -1;
+
+/* system tick */
+struct timespec deadline;
+long tick_ns;
+
+/* display shift register and pixel state */
+uint8_t sr[DISPLAY_REQLEN];
+uint8_t pixels[DISPLAY_COLS];
+
+/* request check, from FLIPDRV_CHECK */
+int check_on;
+unsigned long check_latches;
+unsigned long check_errors;
+
+/* latch trace, one CSV record per latch, from FLIPDRV_TRACE */
+FILE *tracefp;
+struct timespec trace_start;
+
+/* DS3231 registers, time is host clock + offset */
+uint8_t rtc[0x13];
+time_t rtc_offset;
+int rtc_12h;
+int rtc_minute = -1;
+uint8_t rtc_ptr;
+uint8_t rtc_state;		/* 0: idle, 1: start, 2: pointer, 3: write, 4: read */
+uint8_t rtc_hung;		/* bus does not respond, FLIPDRV_NORTC set */
+
+/* EEPROM and panel state file */
+uint8_t eeprom[E2END + 1];
+int statefd = -1;
+
+/* ---- terminal output ---- */
+
+void sim_render(void)
+{
+	char line[DISPLAY_COLS * 3 + 4];
+	uint8_t row;
+	uint8_t col;
+	uint8_t bit;
+	size_t len;
+
+	printf("\033[3;1H+");
+	for (col = 0; col < DISPLAY_COLS; col++)
+		fputs("--", stdout);
+	fputs("+\n", stdout);
+	row = 0;
+	do {
+		bit = (uint8_t) (1U << (DISPLAY_LINES - 1U - row));
+		len = 0;
+		line[len++] = '|';
+		for (col = 0; col < DISPLAY_COLS; col++) {
+			if (pixels[col] & bit) {
+				line[len++] = '#';
+				line[len++] = '#';
+			} else {
+				line[len++] = ' ';
+				line[len++] = ' ';
+			}
+		}
+		line[len++] = '|';
+		line[len++] = '\n';
+		line[len] = '\0';
+		fputs(line, stdout);
+		row++;
+	} while (row < DISPLAY_LINES);
+	putchar('+');
+	for (col = 0; col < DISPLAY_COLS; col++)
+		fputs("--", stdout);
+	fputs("+\n", stdout);
+	fflush(stdout);
+}
+
+void sim_exit(int sig)
+{
+	(void)sig;
+	fputs("\033[?25h\n", stdout);
+	fflush(stdout);
+	if (check_on)
+		fprintf(stderr, "check: %lu latches, %lu errors\n",
+			check_latches, check_errors);
+	_exit(0);
+}
+
+/* ---- DS3231 ---- */
+
+uint8_t bcd(int val)
+{
+	return (uint8_t) (((val / 10) << 4) | (val % 10));
+}
+
+int unbcd(uint8_t val)
+{
+	return (val >> 4) * 10 + (val & 0x0f);
+}
+
+void rtc_time(struct tm *tm)
+{
+	time_t now = time(NULL) + rtc_offset;
+	localtime_r(&now, tm);
+}
+
+/* refresh time registers and alarm 2 flag */
+void rtc_update(void)
+{
+	struct tm tm;
+	int hour;
+	rtc_time(&tm);
+	rtc[0x00] = bcd(tm.tm_sec);
+	rtc[0x01] = bcd(tm.tm_min);
+	if (rtc_12h) {
+		hour = tm.tm_hour % 12;
+		rtc[0x02] = (uint8_t) (0x40 | bcd(hour ? hour : 12));
+		if (tm.tm_hour >= 12)
+			rtc[0x02] |= 0x20;
+	} else {
+		rtc[0x02] = bcd(tm.tm_hour);
+	}
+	rtc[0x03] = (uint8_t) (tm.tm_wday + 1);
+	rtc[0x04] = bcd(tm.tm_mday);
+	rtc[0x05] = bcd(tm.tm_mon + 1);
+	rtc[0x06] = bcd(tm.tm_year % 100);
+	rtc[0x11] = 25;
+	if (rtc_minute >= 0 && tm.tm_min != rtc_minute)
+		rtc[0x0f] |= 0x02;	// A2F
+	rtc_minute = tm.tm_min;
+	if ((rtc[0x0f] & 0x02) && (rtc[0x0e] & 0x06) == 0x06)
+		PINC &= (uint8_t) ~ _BV(SIM_RTCINT);
+	else
+		PINC |= _BV(SIM_RTCINT);
+}
+
+/* apply write to time register */
+void rtc_write(uint8_t reg, uint8_t val)
+{
+	struct tm tm;
+	int hour;
+	if (reg > 0x02) {
+		if (reg < sizeof(rtc))
+			rtc[reg] = val;
+		return;
+	}
+	rtc_time(&tm);
+	if (reg == 0x00) {
+		tm.tm_sec = unbcd(val & 0x7f);
+	} else if (reg == 0x01) {
+		tm.tm_min = unbcd(val & 0x7f);
+	} else if (val & 0x40) {
+		rtc_12h = 1;
+		hour = unbcd(val & 0x1f) % 12;
+		if (val & 0x20)
+			hour += 12;
+		tm.tm_hour = hour;
+	} else {
+		rtc_12h = 0;
+		tm.tm_hour = unbcd(val & 0x3f);
+	}
+	tm.tm_isdst = -1;
+	rtc_offset = mktime(&tm) - time(NULL);
+	rtc_minute = tm.tm_min;
+}
+
+/* ---- HAL ---- */
+
+void hal_timer_init(void)
+{
+	tick_ns = (long)(1000000000.0 * HAL_TICK_CYCLES / F_CPU);
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+}
+
+void hal_timer_sync(void)
+{
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_nsec += tick_ns;
+	while (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_nsec -= 1000000000L;
+		deadline.tv_sec++;
+	}
+}
+
+uint8_t hal_timer_count(void)
+{
+	struct timespec now;
+	long left;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	left = (deadline.tv_sec - now.tv_sec) * 1000000000L
+	    + (deadline.tv_nsec - now.tv_nsec);
+	if (left < 0)
+		left = 0;
+	else if (left > tick_ns)
+		left = tick_ns;
+	return (uint8_t) ((tick_ns - left) * SIM_TICK_COUNTS / (tick_ns + 1));
+}
+
+uint8_t hal_tick(void)
+{
+	return 1U;
+}
+
+uint8_t hal_clock(uint8_t fast)
+{
+	(void)fast;
+	return 0U;
+}
+
+void hal_sleep(void)
+{
+	struct pollfd pfd;
+	struct timespec now;
+	long wait;
+	uint8_t ch;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	wait = (deadline.tv_sec - now.tv_sec) * 1000L
+	    + (deadline.tv_nsec - now.tv_nsec) / 1000000L;
+	if (wait < 0)
+		wait = 0;
+	pfd.fd = ptyfd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	if (poll(&pfd, 1, (int)wait) > 0 && (pfd.revents & POLLIN)) {
+		if (read(ptyfd, &ch, 1) == 1) {
+			UCSR0A = 0;
+			UDR0 = ch;
+			USART_RX_vect();
+			return;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (now.tv_sec > deadline.tv_sec || (now.tv_sec == deadline.tv_sec
+					     && now.tv_nsec >=
+					     deadline.tv_nsec)) {
+		deadline.tv_nsec += tick_ns;
+		while (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_nsec -= 1000000000L;
+			deadline.tv_sec++;
+		}
+		rtc_update();
+		TIMER0_COMPA_vect();
+	}
+}
+
+void hal_uart_init(uint8_t ubrr)
+{
+	(void)ubrr;
+}
+
+void hal_uart_send(uint8_t ch)
+{
+	while (write(ptyfd, &ch, 1) < 0 && errno == EINTR) ;
+}
+
+void hal_spi_init(void)
+{
+}
+
+void hal_spi_send(uint8_t val)
+{
+	memmove(&sr[0], &sr[1], DISPLAY_REQLEN - 1);
+	sr[DISPLAY_REQLEN - 1] = val;
+}
+
+/* report a request that disagrees with the panel model */
+void check_fail(const char *what, uint8_t col, uint8_t line)
+{
+	check_errors++;
+	fprintf(stderr, "check: tick %u col %u line %u: %s\n",
+		SYSTICK, col, line, what);
+}
+
+/* decode request into coil actions, see include/display.h */
+void hal_spi_latch(void)
+{
+	uint8_t check = check_on && bit_is_set(DISPLAY_STAT, DISBSY);
+	uint8_t powered = 0;
+	uint8_t changed = 0;
+	uint8_t col;
+	uint8_t line;
+	uint8_t req;
+	uint8_t shift;
+	uint8_t bit;
+	char act;
+	struct timespec now;
+	if (tracefp) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		fprintf(tracefp, "%ld,%u,%u",
+			(now.tv_sec - trace_start.tv_sec) * 1000000L
+			+ (now.tv_nsec - trace_start.tv_nsec) / 1000L,
+			SYSTICK, hal_timer_count());
+	}
+	for (col = 0; col < DISPLAY_COLS; col++) {
+		shift = (uint8_t) ((col & 0x3U) << 1);
+		line = 0;
+		if (tracefp)
+			fputc(',', tracefp);
+		do {
+			req = sr[(DISPLAY_PANELS - 1U - col / PANEL_COLS)
+				 * DISPLAY_LINES + (DISPLAY_LINES - 1U - line)];
+			bit = (uint8_t) (1U << (DISPLAY_LINES - 1U - line));
+			act = '.';
+			if (check && ((req >> shift) & 0x3U)) {
+				powered = 1;
+				if (((req >> shift) & 0x3U) == 0x3U)
+					check_fail("set and clear", col, line);
+				else if (!((req >> shift) & 0x1U)
+					 != !(display.cur[col] & bit))
+					check_fail("coil disagrees with cur",
+						   col, line);
+			}
+			if ((req >> shift) & 0x1U) {
+				changed |= (uint8_t) (~pixels[col] & bit);
+				pixels[col] |= bit;
+				act = 'S';
+			} else if ((req >> shift) & 0x2U) {
+				changed |= (uint8_t) (pixels[col] & bit);
+				pixels[col] &= (uint8_t) ~ bit;
+				act = 'C';
+			}
+			if (tracefp)
+				fputc(act, tracefp);
+			line++;
+		} while (line < DISPLAY_LINES);
+	}
+	if (tracefp)
+		fputc('\n', tracefp);
+	if (check) {
+		check_latches++;
+		for (col = 0; !powered && col < DISPLAY_COLS; col++) {
+			if (pixels[col] != display.cur[col])
+				check_fail("panel differs from cur", col,
+					   DISPLAY_LINES);
+		}
+	}
+	if (changed) {
+		sim_render();
+		if (statefd >= 0 && pwrite(statefd, pixels, sizeof(pixels),
+					   (off_t) sizeof(eeprom)) < 0)
+			perror("panel");
+	}
+}
+
+void hal_twi_init(void)
+{
+	PINC |= _BV(SIM_SDA);
+}
+
+uint8_t hal_twi_recover(void)
+{
+	return rtc_hung;
+}
+
+uint8_t hal_twi_start(void)
+{
+	if (rtc_hung) {
+		return HAL_TWI_TIMEOUT;
+	}
+	rtc_state = 1;
+	return 0x08;
+}
+
+uint8_t hal_twi_write(uint8_t ch)
+{
+	switch (rtc_state) {
+	case 1:
+		if (ch == 0xd0) {
+			rtc_state = 2;
+			return 0x18;
+		} else if (ch == 0xd1) {
+			rtc_state = 4;
+			rtc_update();
+			return 0x40;
+		}
+		rtc_state = 0;
+		return 0x20;
+	case 2:
+		rtc_ptr = ch;
+		rtc_state = 3;
+		return 0x28;
+	case 3:
+		if (rtc_ptr >= sizeof(rtc))
+			rtc_ptr = 0;
+		rtc_write(rtc_ptr++, ch);
+		return 0x28;
+	default:
+		return 0x00;
+	}
+}
+
+uint8_t hal_twi_read(uint8_t * ch, uint8_t ack)
+{
+	*ch = 0xff;
+	if (rtc_state == 4) {
+		if (rtc_ptr >= sizeof(rtc))
+			rtc_ptr = 0;
+		*ch = rtc[rtc_ptr++];
+	}
+	return ack ? 0x50 : 0x58;
+}
+
+void hal_twi_stop(void)
+{
+	rtc_state = 0;
+	rtc_update();
+}
+
+uint8_t hal_eeprom_read(uint16_t addr)
+{
+	return eeprom[addr & E2END];
+}
+
+void hal_eeprom_write(uint16_t addr, uint8_t val)
+{
+	addr &= E2END;
+	if (eeprom[addr] != val) {
+		eeprom[addr] = val;
+		if (statefd >= 0
+		    && pwrite(statefd, &val, 1, (off_t) addr) != 1)
+			perror("eeprom");
+	}
+}
+
+uint8_t hal_eeprom_ready(void)
+{
+	return 1;
+}
+
+uint16_t hal_stack_free(void)
+{
+	return 0;
+}
+
+/* ---- setup ---- */
+
+int main(int argc, char **argv)
+{
+	struct termios tio;
+	const char *name;
+	const char *path;
+	int slave;
+	unsigned col;
+
+	ptyfd = posix_openpt(O_RDWR | O_NOCTTY);
+	if (ptyfd < 0 || grantpt(ptyfd) || unlockpt(ptyfd)) {
+		perror("pty");
+		return 1;
+	}
+	name = ptsname(ptyfd);
+
+	/* keep slave open in raw mode so clients may come and go */
+	slave = open(name, O_RDWR | O_NOCTTY);
+	if (slave < 0 || tcgetattr(slave, &tio)) {
+		perror(name);
+		return 1;
+	}
+	cfmakeraw(&tio);
+	tcsetattr(slave, TCSANOW, &tio);
+	fcntl(ptyfd, F_SETFL, fcntl(ptyfd, F_GETFL) | O_NONBLOCK);
+	if (argc > 1) {
+		unlink(argv[1]);
+		if (symlink(name, argv[1]))
+			perror(argv[1]);
+	}
+
+	rtc_hung = getenv("FLIPDRV_NORTC") != NULL;
+	check_on = getenv("FLIPDRV_CHECK") != NULL;
+	path = getenv("FLIPDRV_TRACE");
+	if (path != NULL) {
+		tracefp = fopen(path, "w");
+		if (tracefp == NULL) {
+			perror(path);
+		} else {
+			clock_gettime(CLOCK_MONOTONIC, &trace_start);
+			fprintf(tracefp, "time_us,tick,count");
+			for (col = 0; col < DISPLAY_COLS; col++)
+				fprintf(tracefp, ",col%u", col);
+			fputc('\n', tracefp);
+			setvbuf(tracefp, NULL, _IOLBF, 0);
+		}
+	}
+	path = getenv("FLIPDRV_STATE");
+	if (path == NULL)
+		path = SIM_STATE;
+	memset(eeprom, 0xff, sizeof(eeprom));
+	statefd = open(path, O_RDWR | O_CREAT, 0644);
+	if (statefd < 0) {
+		perror(path);
+	} else if (read(statefd, eeprom, sizeof(eeprom)) < (ssize_t)
+		   sizeof(eeprom)
+		   || read(statefd, pixels, sizeof(pixels)) < (ssize_t)
+		   sizeof(pixels)) {
+		memset(eeprom, 0xff, sizeof(eeprom));
+		memset(pixels, 0, sizeof(pixels));
+		if (pwrite(statefd, eeprom, sizeof(eeprom), 0) < 0
+		    || pwrite(statefd, pixels, sizeof(pixels),
+			      (off_t) sizeof(eeprom)) < 0)
+			perror(path);
+	}
+
+	fprintf(stderr, "%s\n", name);
+	signal(SIGINT, sim_exit);
+	signal(SIGTERM, sim_exit);
+	printf("\033[2J\033[H\033[?25lavr-flipdrv host: %s\n", name);
+	sim_render();
+
+	firmware_main();
+	return 0;
+}
@@ -4,70 +4,184 @@
  * AVR m328p (Nano) Serial Flipdot Display and Clock
  */
 #include <stdint.h>
-#include <avr/io.h>
-#include <avr/interrupt.h>
-#include <avr/sleep.h>
-#include <util/atomic.h>
+#include "hal.h"
 #include "util.h"
 #include "display.h"
 #include "ds3231.h"
+#include "config.h"
+#include "gfx.h"
+#include "trace.h"
 
-#define SYSTICK EEARL
-#define CLOCKSTAT EEDR
+#define CLOCKSTAT clockstat	// EEPROM registers hold config writes
 #define PAUSE 0
 #define DISABLE 1
 #define BHOUR 3			// PORTD.3
 #define BMIN 7			// PORTD.7
 #define RTCINT 3		// PORTC.3
 
+/* Return to low CPU clock after this many idle ticks */
+#define IDLE_TICKS 80
+
+/* The baud rate divisor is rescaled with the CPU clock, so only switch
+ * after a full tick without input: longer than a byte at 1200 baud */
+#define RX_QUIET 2
+
+#define RTC_RETRY 40		// Ticks to hold off RTC reads after a failure
+
 #define NAK 0x15;
 #define BUFLEN 0x20
 #define BUFMASK (BUFLEN-1)
 #define BUFWI GPIOR1
 #define BUFRI GPIOR2
 uint8_t rdbuf[BUFLEN];
+volatile uint8_t clockstat;
+volatile uint8_t rxseen;
+uint8_t rxquiet;		// Ticks since rxseen was last set
+uint8_t idleticks;
+
+/* Serial link mode flags */
+#define ACKMODE 0
+#define SELECT 1		// Addressed frame is for this controller
+#define BCAST 2			// Selected by broadcast address
+#define ADDRNEXT 3		// Next byte is a frame address
+#define MUTE 4			// Shared bus, not allowed to transmit
+#define HOSTUPD 5		// Current display update was requested by host
+#define ACK 0x06
+#define SOH 0x01
+#define BCASTADDR 0x7f
+uint8_t linkstat;
+uint8_t rxstat;			// Link flags as bytes arrive, ahead of linkstat
+uint8_t ackseq;
+
+/* Escape sequence: ESC, command letter, parameters offset by '0' */
+#define ESC 0x1b
+#define ESCLEN 4
+#define ESCARG(n) ((uint8_t) (in->escbuf[n] - 0x30))
+
+/* Text input state, kept separately for host and internal input */
+struct input_stat {
+	uint8_t pos;		// Current column
+	uint8_t drawn;		// Edited by escape commands, keep at line start
+	uint8_t layer;		// Display layer written
+	uint8_t esccnt;
+	uint8_t escbuf[ESCLEN + 1];
+};
+struct input_stat host;
+struct input_stat local = {.layer = DISPLAY_CLOCK };
+struct input_stat *in = &host;
+
+/* Internal events: clock, buttons and command responses */
+#define EVTLEN 0x20
+#define EVTMASK (EVTLEN-1)
+uint8_t evtbuf[EVTLEN];
+uint8_t evtwi;
+uint8_t evtri;
+
+/* UBRR0 divisors with U2X0 for 1200, 2400, 4800, 9600, 19200 baud */
+#define BAUD_DEFAULT 3
+uint8_t baud_ubrr[] = { 207, 103, 51, 25, 12 };
+
+/* Cached time of day, advanced from SYSTICK and resynced on RTC alarm */
+struct ds3231_stat now;
+uint32_t subtick;
+
+/* I2C transactions used by the most recent clock event */
+uint8_t xfer_event;
+uint8_t rtcwait;
+uint8_t newminute;		/* cached time reached a new minute */
 
 /* Function prototypes */
+void queue_serial(uint8_t ch);
 void read_rtc(void);
+void sync_rtc(void);
+uint8_t may_reply(void);
+void send_status(void);
+void send_trace(void);
+void send_crc(void);
+void send_columns(uint8_t * buf);
 
 /* Interrupt handlers */
 ISR(TIMER0_COMPA_vect)
 {
-	++SYSTICK;
+	if (hal_tick()) {
+		++SYSTICK;
+		display_step();
+	}
 }
 
+/* Frame addresses are tracked as bytes arrive, so bytes for other
+ * controllers never take space in the input queue while a display
+ * update holds it, and chain bytes are forwarded without delay */
 ISR(USART_RX_vect)
 {
 	uint8_t status = UCSR0A;
 	barrier();
 	uint8_t tmp = UDR0;
-	uint8_t look = (uint8_t) ((BUFWI + 1) & BUFMASK);
-	if (look != BUFRI) {
-		if (status & (_BV(FE0) | _BV(DOR0))) {
-			rdbuf[look] = NAK;
+	uint8_t mine = 1;
+	if (status & (_BV(FE0) | _BV(DOR0))) {
+		tmp = NAK;
+	}
+	if (config.addr != CONFIG_NOADDR) {
+		mine = 0;
+		if (bit_is_set(rxstat, ADDRNEXT)) {
+			rxstat &= _BV(ACKMODE);
+			if (tmp == BCASTADDR) {
+				rxstat |= _BV(SELECT) | _BV(BCAST);
+			} else if ((uint8_t) (tmp - 0x30) == config.addr) {
+				rxstat |= _BV(SELECT);
+			}
+			if (bit_is_set(rxstat, SELECT)) {
+				// Frame start for read_address()
+				queue_serial(SOH);
+				queue_serial(tmp);
+			}
+		} else if (tmp == SOH) {
+			rxstat &= _BV(ACKMODE);
+			rxstat |= _BV(ADDRNEXT);
 		} else {
-			rdbuf[look] = tmp;
+			mine = bit_is_set(rxstat, SELECT);
 		}
+	}
+	if (mine) {
+		queue_serial(tmp);
+		// Track SO and SI ahead of the main loop for forwarding
+		if (tmp == 0x0e) {
+			rxstat |= _BV(ACKMODE);
+		} else if (tmp == 0x0f) {
+			rxstat &= (uint8_t) ~ _BV(ACKMODE);
+		}
+	}
+	if (bit_is_set(config.link, CONFIG_CHAIN)
+	    && (bit_is_clear(rxstat, ACKMODE) || !mine
+		|| bit_is_set(rxstat, BCAST))) {
+		hal_uart_send(tmp);
+	}
+	CLOCKSTAT |= _BV(PAUSE);
+	rxseen = 1;
+}
+
+/* Write received byte to serial input queue */
+void queue_serial(uint8_t ch)
+{
+	uint8_t look = (uint8_t) ((BUFWI + 1) & BUFMASK);
+	if (look != BUFRI) {
+		rdbuf[look] = ch;
 		barrier();
 		BUFWI = look;
 	}			// Ignore overrun
-	CLOCKSTAT |= _BV(PAUSE);
 }
 
-/* Write byte to input queue */
+/* Write byte to internal event queue */
 void queue_input(uint8_t ch)
 {
-	ATOMIC_BLOCK(ATOMIC_FORCEON) {
-		uint8_t look = (uint8_t) ((BUFWI + 1) & BUFMASK);
-		if (look != BUFRI) {
-			rdbuf[look] = ch;
-			barrier();
-			BUFWI = look;
-		}		// Ignore overrun
-	}
+	uint8_t look = (uint8_t) ((evtwi + 1) & EVTMASK);
+	if (look != evtri) {
+		evtbuf[look] = ch;
+		evtwi = look;
+	}			// Ignore overrun
 }
 
-/* Write null-terminated string to input queue */
+/* Write null-terminated string to internal event queue */
 void queue_string(uint8_t * msg)
 {
 	while (*msg) {
@@ -75,12 +189,239 @@ void queue_string(uint8_t * msg)
 	}
 }
 
+/* Return number of parameters for escape command */
+uint8_t escape_len(uint8_t cmd)
+{
+	switch (cmd) {
+	case 'c':
+	case 's':
+	case 'x':
+		return 4;
+	case 'g':
+	case 'h':
+	case 'v':
+	case 'w':
+		return 3;
+	case 'a':
+	case 'd':
+	case 'e':
+		return 2;
+	case 'l':
+	case 'm':
+	case 'o':
+	case 'r':
+	case 't':
+	case '<':
+	case '>':
+	case '{':
+	case '}':
+	case 'b':
+	case 'p':
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/* Handle completed escape sequence */
+void handle_escape(void)
+{
+	switch (in->escbuf[0]) {
+	case 'a':
+		// Set bus address and topology
+		config.addr = ESCARG(1);
+		if (config.addr > CONFIG_NOADDR) {
+			config.addr = CONFIG_NOADDR;
+		}
+		config.link = ESCARG(2) & (_BV(CONFIG_CHAIN) | _BV(CONFIG_LAST));
+		if (config.link) {
+			config.link |= _BV(CONFIG_CHAIN);
+		}
+		config_save();
+		linkstat &= _BV(ACKMODE);
+		if (config.addr != CONFIG_NOADDR) {
+			linkstat |= _BV(SELECT);	// Until next frame
+		}
+		break;
+	case 'c':
+		// Clear rectangle x y w h
+		gfx_rect(ESCARG(1), ESCARG(3), gfx_lines(ESCARG(2), ESCARG(4)),
+			 GFX_CLR);
+		in->drawn = 1;
+		break;
+	case 's':
+		// Set rectangle x y w h
+		gfx_rect(ESCARG(1), ESCARG(3), gfx_lines(ESCARG(2), ESCARG(4)),
+			 GFX_SET);
+		in->drawn = 1;
+		break;
+	case 'x':
+		// Invert rectangle x y w h
+		gfx_rect(ESCARG(1), ESCARG(3), gfx_lines(ESCARG(2), ESCARG(4)),
+			 GFX_XOR);
+		in->drawn = 1;
+		break;
+	case 'h':
+		// Horizontal line x y w
+		gfx_rect(ESCARG(1), ESCARG(3), gfx_lines(ESCARG(2), 1U),
+			 GFX_SET);
+		in->drawn = 1;
+		break;
+	case 'v':
+		// Vertical line x y h
+		gfx_rect(ESCARG(1), 1U, gfx_lines(ESCARG(2), ESCARG(3)),
+			 GFX_SET);
+		in->drawn = 1;
+		break;
+	case '<':
+		// Shift left n columns
+		gfx_left(ESCARG(1), 0U);
+		in->drawn = 1;
+		break;
+	case '>':
+		// Shift right n columns
+		gfx_right(ESCARG(1), 0U);
+		in->drawn = 1;
+		break;
+	case '{':
+		// Roll left n columns
+		gfx_left(ESCARG(1), 1U);
+		in->drawn = 1;
+		break;
+	case '}':
+		// Roll right n columns
+		gfx_right(ESCARG(1), 1U);
+		in->drawn = 1;
+		break;
+	case 'g':
+		// Grab w columns from x into sprite s
+		gfx_grab(ESCARG(1), ESCARG(2), ESCARG(3));
+		break;
+	case 'd':
+		// Draw sprite s at column x
+		gfx_blit(ESCARG(1), ESCARG(2));
+		in->drawn = 1;
+		break;
+	case 'l':
+		// Draw into layer n
+		if (ESCARG(1) < DISPLAY_LAYERS) {
+			in->layer = ESCARG(1);
+			display_select(in->layer);
+		}
+		break;
+	case 'e':
+		// Hide layer l (0), show opaque (1) or as overlay (2)
+		display_show(ESCARG(1), ESCARG(2));
+		break;
+	case 'w':
+		// Limit layer l to w columns from x
+		display_region(ESCARG(1), ESCARG(2), ESCARG(3));
+		break;
+	case 'r':
+		// Clear trace and start (1) or stop (0) capture
+		trace_enable(ESCARG(1));
+		break;
+	case 'q':
+		// Report captured trace
+		if (may_reply()) {
+			send_trace();
+		}
+		break;
+	case 'k':
+		// Report checksums of panel and display buffer
+		if (may_reply()) {
+			send_crc();
+		}
+		break;
+	case 'm':
+		// Report panel (0) or display buffer (1) columns
+		if (may_reply()) {
+			send_columns(ESCARG(1) ? display.buf : display.cur);
+		}
+		break;
+	case 'b':
+		// Set baud rate index, applied after reset
+		if (ESCARG(1) < sizeof(baud_ubrr)) {
+			config.baud = ESCARG(1);
+			config_save();
+		}
+		break;
+	case 'p':
+		// Set number of columns powered during sweep
+		display_power(ESCARG(1));
+		config.colpower = ESCARG(1);
+		config_save();
+		break;
+	case 'o':
+		// Set sweep column order
+		if (ESCARG(1) < DISPLAY_ORDERS) {
+			display_order(ESCARG(1));
+			config.order = ESCARG(1);
+			config_save();
+		}
+		break;
+	case 't':
+		// Set transition effect
+		if (ESCARG(1) < DISPLAY_EFFECTS) {
+			display_effect(ESCARG(1));
+			config.effect = ESCARG(1);
+			config_save();
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+/* Collect escape sequence bytes, return non-zero if msg was consumed */
+uint8_t read_escape(uint8_t msg)
+{
+	if (msg == ESC) {
+		in->esccnt = 1;
+		return 1;
+	}
+	if (in->esccnt == 0) {
+		return 0;
+	}
+	if (msg < 0x30 || msg > 0x7f) {
+		// Cancel sequence and handle msg as normal input
+		in->esccnt = 0;
+		return 0;
+	}
+	in->escbuf[in->esccnt - 1] = msg;
+	if (in->esccnt > escape_len(in->escbuf[0])) {
+		in->esccnt = 0;
+		handle_escape();
+	} else {
+		++in->esccnt;
+	}
+	return 1;
+}
+
+/* Return non-zero for control codes that leave the current line alone */
+uint8_t is_setting(uint8_t msg)
+{
+	switch (msg) {
+	case 0x05:
+	case 0x0e:
+	case 0x0f:
+	case 0x11:
+	case 0x12:
+	case 0x13:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
 /* Handle text input */
 void handle_text(uint8_t msg)
 {
-	static uint8_t pos = 0;
+	if (read_escape(msg)) {
+		return;
+	}
 
-	if (pos == 0) {
+	if (in->pos == 0 && !in->drawn && !is_setting(msg)) {
 		display_clear();
 	}
 	switch (msg) {
@@ -88,37 +429,55 @@ void handle_text(uint8_t msg)
 		// EOT
 		display_trigger();
 		break;
+	case 0x05:
+		// ENQ : Report time and I2C usage
+		if (may_reply()) {
+			send_status();
+		}
+		break;
 	case 0x07:
 		// Bell
 		display_fill(0xff);
 		display_flush();
-		pos = 0;
+		in->pos = 0;
+		in->drawn = 0;
 		display_trigger();
 		break;
 	case 0x08:
 		// Backspace
-		if (pos)
-			--pos;
+		if (in->pos)
+			--in->pos;
 		break;
 	case 0x09:
 		// Tab
-		pos = (uint8_t) (pos + 4);
+		in->pos = (uint8_t) (in->pos + 4);
 		break;
 	case 0x0a:
 		// Line Feed
-		pos = 0;
+		in->pos = 0;
+		in->drawn = 0;
 		display_trigger();
 		break;
 	case 0x0c:
 		// Form Feed
-		pos = 0;
+		in->pos = 0;
+		in->drawn = 0;
 		display_clear();
 		display_flush();
 		display_trigger();
 		break;
 	case 0x0d:
 		// Carriage Return
-		pos = 0;
+		in->pos = 0;
+		break;
+	case 0x0e:
+		// Shift Out : Acknowledge display updates instead of echo
+		linkstat |= _BV(ACKMODE);
+		ackseq = 0;
+		break;
+	case 0x0f:
+		// Shift In : Echo input
+		linkstat &= (uint8_t) ~ _BV(ACKMODE);
 		break;
 	case 0x10:
 		// Data Link Escape
@@ -127,6 +486,9 @@ void handle_text(uint8_t msg)
 	case 0x11:
 		// DC1 : Turn on clock
 		CLOCKSTAT = 0;
+		config.clock = 0;
+		config_save();
+		display_show(DISPLAY_CLOCK, DISPLAY_OVERLAY);
 		queue_string((uint8_t *) "\x0d\x10\xc7\x4f\x4e\x0a");
 		read_rtc();
 		break;
@@ -137,24 +499,28 @@ void handle_text(uint8_t msg)
 	case 0x13:
 		// DC3 : Turn off clock
 		CLOCKSTAT |= _BV(DISABLE);
-		queue_string((uint8_t *) "\x0d\x10\xc5\x4f\x46\x46\x0a\x0c");
+		config.clock = _BV(DISABLE);
+		config_save();
+		// Show OFF on the clock layer, then hide it
+		queue_string((uint8_t *)
+			     "\x0d\x10\xc5\x4f\x46\x46\x0a\x1b\x65\x31\x30\x04");
 		break;
 	case 0x20:
 		// Space
-		++pos;
+		++in->pos;
 		break;
 	default:
 		if (msg > 0x20 && msg < 0x7f) {
 			// Printable text
-			display_char(msg, pos);
-			pos = (uint8_t) (pos + 4);
+			display_char(msg, in->pos);
+			in->pos = (uint8_t) (in->pos + 4);
 		} else if ((msg & 0xe0) == 0x80) {
 			// Raw bits
-			display_data(msg, pos);
-			++pos;
+			display_data(msg, in->pos);
+			++in->pos;
 		} else if ((msg & 0xe0) == 0xc0) {
 			// Column offset
-			pos = msg & 0x1f;
+			in->pos = msg & 0x1f;
 		}
 		break;
 	}
@@ -199,8 +565,151 @@ uint8_t debounce(void)
 /* Write byte to serial output */
 void send_serial(uint8_t ch)
 {
-	loop_until_bit_is_set(UCSR0A, UDRE0);
-	UDR0 = ch;
+	if (bit_is_clear(linkstat, MUTE)) {
+		hal_uart_send(ch);
+	}
+}
+
+/* Return non-zero if acks and reports may be sent: in a daisy chain
+ * they would be read as input by the next controller, so only the
+ * last one, whose TX reaches the host, replies */
+uint8_t may_reply(void)
+{
+	return bit_is_clear(config.link, CONFIG_CHAIN)
+	    || bit_is_set(config.link, CONFIG_LAST);
+}
+
+/* Write low nibble to serial output as a hex digit */
+void send_nibble(uint8_t val)
+{
+	val &= 0x0f;
+	if (val > 9)
+		val = (uint8_t) (val + 'a' - 10);
+	else
+		val = (uint8_t) (val + '0');
+	send_serial(val);
+}
+
+/* Write byte to serial output as two hex digits */
+void send_hex(uint8_t val)
+{
+	send_nibble(val >> 4);
+	send_nibble(val);
+}
+
+/* Write null-terminated string to serial output */
+void send_string(uint8_t * msg)
+{
+	while (*msg) {
+		send_serial(*msg++);
+	}
+}
+
+/* Report cached time and I2C transaction counts */
+void send_status(void)
+{
+	send_string((uint8_t *) "T ");
+	send_hex(now.hour & 0x1f);
+	send_serial(':');
+	send_hex(now.minute);
+	send_serial(':');
+	send_hex(now.second);
+	send_string((uint8_t *) " I ");
+	send_hex((uint8_t) (ds3231_xfers >> 8));
+	send_hex((uint8_t) ds3231_xfers);
+	send_serial(' ');
+	send_hex(xfer_event);
+	send_string((uint8_t *) " E ");
+	send_hex(ds3231_timeouts);
+	send_serial(' ');
+	send_hex(ds3231_errors);
+	send_serial(' ');
+	send_hex(ds3231_stuck);
+	send_string((uint8_t *) " S ");
+	uint16_t stack = hal_stack_free();
+	send_hex((uint8_t) (stack >> 8));
+	send_hex((uint8_t) stack);
+	send_string((uint8_t *) " L ");
+	send_hex(trace_minlat);
+	send_serial(' ');
+	send_hex(trace_maxlat);
+	send_string((uint8_t *) "\r\n");
+}
+
+/* Report and remove all captured trace entries */
+void send_trace(void)
+{
+	struct trace_entry e;
+	uint8_t i;
+	while (trace_read(&e)) {
+		send_hex(e.tick);
+		send_serial(' ');
+		send_hex(e.count);
+		send_serial(' ');
+		i = DISPLAY_GROUPS;
+		do {
+			i--;
+			send_hex(e.cols[i]);
+		} while (i);
+		send_serial(' ');
+		send_hex(e.coils);
+		send_string((uint8_t *) "\r\n");
+	}
+	send_string((uint8_t *) ".\r\n");
+}
+
+/* Report CRC-16 of panel pixels and display buffer */
+void send_crc(void)
+{
+	uint16_t crc = display_crc(display.cur);
+	send_string((uint8_t *) "P ");
+	send_hex((uint8_t) (crc >> 8));
+	send_hex((uint8_t) crc);
+	crc = display_crc(display.buf);
+	send_string((uint8_t *) " B ");
+	send_hex((uint8_t) (crc >> 8));
+	send_hex((uint8_t) crc);
+	send_string((uint8_t *) "\r\n");
+}
+
+/* Report pixel columns as raw data bytes */
+void send_columns(uint8_t * buf)
+{
+	uint8_t col = 0;
+	do {
+		send_serial((uint8_t) (0x80U | buf[col]));
+		col++;
+	} while (col < DISPLAY_COLS);
+	send_string((uint8_t *) "\r\n");
+}
+
+/* Track frame addresses in queued input, which holds only frames for
+ * this controller, return non-zero if ch is frame content */
+uint8_t read_address(uint8_t ch)
+{
+	if (config.addr == CONFIG_NOADDR) {
+		return 1;
+	}
+	if (bit_is_set(linkstat, ADDRNEXT)) {
+		linkstat &= (uint8_t) ~ _BV(ADDRNEXT);
+		if (ch == BCASTADDR) {
+			linkstat |= _BV(SELECT) | _BV(BCAST);
+		} else if ((uint8_t) (ch - 0x30) == config.addr) {
+			linkstat |= _BV(SELECT);
+		}
+	} else if (ch == SOH) {
+		linkstat &= (uint8_t) ~ (_BV(SELECT) | _BV(BCAST));
+		linkstat |= _BV(ADDRNEXT);
+	} else {
+		return bit_is_set(linkstat, SELECT);
+	}
+	// Only talk on a shared bus when addressed individually
+	linkstat &= (uint8_t) ~ _BV(MUTE);
+	if (bit_is_clear(config.link, CONFIG_CHAIN)
+	    && (linkstat & (_BV(SELECT) | _BV(BCAST))) != _BV(SELECT)) {
+		linkstat |= _BV(MUTE);
+	}
+	return 0;
 }
 
 /* Read and process next byte from input queue */
@@ -209,11 +718,53 @@ void read_queue(void)
 	if (BUFRI != BUFWI) {
 		uint8_t look = (uint8_t) ((BUFRI + 1) & BUFMASK);
 		uint8_t ch = rdbuf[look];
+		uint8_t mine;
 		barrier();
 		BUFRI = look;
-		handle_text(ch);
+		mine = read_address(ch);
+		if (mine) {
+			display_select(host.layer);
+			handle_text(ch);
+			if (bit_is_set(DISPLAY_STAT, DISUPD)) {
+				linkstat |= _BV(HOSTUPD);
+				if (bit_is_set(linkstat, BCAST)) {
+					hal_timer_sync();	// Align broadcast updates
+				}
+			}
+		}
 		barrier();
-		send_serial(ch);
+		// Chain bytes were forwarded by USART_RX_vect
+		if (bit_is_clear(linkstat, ACKMODE)
+		    && bit_is_clear(config.link, CONFIG_CHAIN)) {
+			send_serial(ch);
+		}
+	}
+}
+
+/* Handle next internal event: not echoed or address filtered */
+void read_event(void)
+{
+	if (evtri != evtwi) {
+		evtri = (uint8_t) ((evtri + 1) & EVTMASK);
+		in = &local;
+		display_select(local.layer);
+		handle_text(evtbuf[evtri]);
+		in = &host;
+		if (bit_is_set(DISPLAY_STAT, DISUPD)) {
+			linkstat &= (uint8_t) ~ _BV(HOSTUPD);
+		}
+	}
+}
+
+/* Report completed host display update in ack mode */
+void send_ack(void)
+{
+	if (bit_is_set(linkstat, ACKMODE) && bit_is_set(linkstat, HOSTUPD)) {
+		if (may_reply()) {
+			send_serial(ACK);
+			send_serial(ackseq);
+		}
+		++ackseq;
 	}
 }
 
@@ -258,55 +809,111 @@ void update_time(struct ds3231_stat *stat)
 	queue_input(0x0a);
 }
 
-/* Read from RTC and update display */
+/* Update display with cached time unless paused or disabled */
+void show_time(void)
+{
+	if (CLOCKSTAT) {
+		CLOCKSTAT &= (uint8_t) ~ _BV(PAUSE);
+	} else {
+		update_time(&now);
+	}
+}
+
+/* Resync cached time from RTC and update display, showing the last
+ * known time if the RTC does not answer */
 void read_rtc(void)
 {
 	struct ds3231_stat ds;
 	if (ds3231_read(&ds)) {
-		if (CLOCKSTAT) {
-			CLOCKSTAT &= (uint8_t) ~ _BV(PAUSE);
-		} else {
-			update_time(&ds);
+		now = ds;
+		subtick = 0;
+	} else {
+		rtcwait = RTC_RETRY;	// Keep soft clock running
+	}
+	show_time();
+}
+
+/* Resync cached time on the RTC alarm. The soft clock draws each new
+ * minute itself, so only redraw if the RTC moved the time shown */
+void sync_rtc(void)
+{
+	struct ds3231_stat ds;
+	if (ds3231_read(&ds)) {
+		if (ds.minute != now.minute || ds.hour != now.hour) {
+			newminute = 1;
 		}
+		now = ds;
+		subtick = 0;
+	} else {
+		rtcwait = RTC_RETRY;	// Keep soft clock running
 	}
 }
 
-/* Increment hour value on RTC, ignoring AM/PM flag */
-void increment_hour(void)
+/* Return packed BCD value incremented by one */
+uint8_t bcd_inc(uint8_t val)
 {
-	struct ds3231_stat stat;
-	ds3231_read(&stat);
-	uint8_t t1 = stat.hour & 0x1f;
+	if ((val & 0x0f) == 0x9) {
+		return (uint8_t) ((val & 0xf0) + 0x10);
+	}
+	return (uint8_t) (val + 1U);
+}
+
+/* Return next 12 hour BCD hour value, without AM/PM or mode flags */
+uint8_t hour_inc(uint8_t hour)
+{
+	uint8_t t1 = hour & 0x1f;
 	if (t1 == 0x12) {
-		t1 = 0x01;
-	} else if ((t1 & 0x0f) == 0x9) {
-		t1 = 0x10;
-	} else {
-		t1++;
+		return 0x01;
+	}
+	return bcd_inc(t1);
+}
+
+/* Advance cached time by the number of elapsed system ticks */
+void clock_tick(uint8_t ticks)
+{
+	subtick += HAL_TICK_CYCLES * ticks;
+	while (subtick >= F_CPU) {
+		subtick -= (uint32_t) F_CPU;
+		now.second = bcd_inc(now.second);
+		if (now.second >= 0x60) {
+			now.second = 0x00;
+			now.minute = bcd_inc(now.minute);
+			newminute = 1;	// Redraw without waiting for the RTC
+			if (now.minute >= 0x60) {
+				now.minute = 0x00;
+				if ((now.hour & 0x1f) == 0x11) {
+					now.hour ^= 0x20;	// AM/PM
+				}
+				now.hour = (uint8_t) ((now.hour & 0x60) |
+						      hour_inc(now.hour));
+			}
+		}
 	}
-	t1 = t1 | 0x40;
+}
+
+/* Increment hour value on RTC, ignoring AM/PM flag */
+void increment_hour(void)
+{
+	uint8_t t1 = (uint8_t) (hour_inc(now.hour) | 0x40);
 	ds3231_hours(t1);
+	now.hour = t1;
 	CLOCKSTAT = 0;
-	read_rtc();
+	show_time();
 }
 
 /* Increment minute value on RTC and zero seconds */
 void increment_minute(void)
 {
-	struct ds3231_stat stat;
-	ds3231_read(&stat);
-	uint8_t t1 = stat.minute & 0x7f;
-	if (t1 == 0x59) {
+	uint8_t t1 = bcd_inc(now.minute & 0x7f);
+	if (t1 >= 0x60) {
 		t1 = 0x00;
-	} else if ((t1 & 0x0f) == 0x9) {
-		t1 = (uint8_t) ((t1 & 0x70) + 0x10);
-	} else {
-		t1++;
 	}
-	ds3231_seconds(0x00);
-	ds3231_minutes(t1);
+	ds3231_time(0x00, t1);
+	now.second = 0x00;
+	now.minute = t1;
+	subtick = 0;
 	CLOCKSTAT = 0;
-	read_rtc();
+	show_time();
 }
 
 /* Handle button press and release events */
@@ -331,45 +938,113 @@ void read_buttons(void)
 void main(void)
 {
 	uint8_t lt = 0;
+	uint8_t tick;
+	uint16_t xm = 0;
 
 	// Init timer
-	OCR0A = 48;
-	TCCR0A = _BV(WGM01);
-	TCCR0B = _BV(CS02) | _BV(CS00);
-	TIMSK0 |= _BV(OCIE0A);
-
-	// Init 9600,8n1 serial I/O w/ interrupt receive
-	UBRR0L = 12;
-	UCSR0B = _BV(RXCIE0) | _BV(RXEN0) | _BV(TXEN0);
-	UCSR0C = _BV(UCSZ01) | _BV(UCSZ00);
-
-	// Set up push buttons
-	PORTD = _BV(BHOUR) | _BV(BMIN);
+	hal_timer_init();
 
 	// Init RTC + Display
 	ds3231_init();
 	display_init();
 
-	// Send initial animation
-	queue_string((uint8_t *) "\x0c\x10\xc7\x8e\x8c\xcb\x86\x8e\x0a");
+	// Restore settings and last frame, or start with defaults
+	if (config_load()) {
+		display_restore(config.panel, config.back);
+		display_flush();	// Stored panel image may be stale
+	} else {
+		config.baud = BAUD_DEFAULT;
+		config.colpower = DISPLAY_COLPOWER;
+		config.addr = CONFIG_NOADDR;
+		config.order = DISPLAY_LTR;
+		config.effect = DISPLAY_CUT;
+		// Send initial animation
+		queue_string((uint8_t *)
+			     "\x0c\x10\xc7\x8e\x8c\xcb\x86\x8e\x0a");
+	}
+	if (config.baud >= sizeof(baud_ubrr)) {
+		config.baud = BAUD_DEFAULT;
+	}
+	display_power(config.colpower);
+	display_order(config.order);
+	display_effect(config.effect);
+	if (config.addr > CONFIG_NOADDR) {
+		config.addr = CONFIG_NOADDR;
+	}
+	if (config.addr != CONFIG_NOADDR
+	    && bit_is_clear(config.link, CONFIG_CHAIN)) {
+		linkstat = _BV(MUTE);	// Wait to be addressed
+	}
+	CLOCKSTAT = config.clock;
+	if (bit_is_clear(CLOCKSTAT, DISABLE)) {
+		display_show(DISPLAY_CLOCK, DISPLAY_OVERLAY);
+	}
+
+	// Init 8n1 serial I/O w/ interrupt receive
+	hal_uart_init(baud_ubrr[config.baud]);
+
+	// Timer, serial and display are set up: start taking interrupts
+	sei();
+
+	// Set up push buttons
+	PORTD = _BV(BHOUR) | _BV(BMIN);
+
 	read_rtc();
 
 	// Main loop
 	do {
-		sleep_mode();
-		if (SYSTICK != lt) {
-			lt = SYSTICK;
+		hal_sleep();
+		tick = SYSTICK;	// Single read, ISR may advance it
+		if (tick != lt) {
+			clock_tick((uint8_t) (tick - lt));
+			lt = tick;
 			display_tick();
+			if (bit_is_set(DISPLAY_STAT, DISDONE)) {
+				DISPLAY_STAT &= (uint8_t) ~ _BV(DISDONE);
+				display_save(config.panel, config.back);
+				config_save_frame();
+				send_ack();
+			}
+			config_tick();
 			read_buttons();
+			if (rtcwait) {
+				--rtcwait;
+			}
+			if (BUFRI != BUFWI || evtri != evtwi
+			    || (DISPLAY_STAT & (_BV(DISBSY) | _BV(DISUPD)))) {
+				idleticks = 0;
+			} else if (idleticks < IDLE_TICKS) {
+				++idleticks;
+			}
+			if (rxseen) {
+				rxseen = 0;
+				rxquiet = 0;
+			} else if (rxquiet < RX_QUIET) {
+				++rxquiet;
+			} else {
+				hal_clock(idleticks < IDLE_TICKS);
+			}
 		}
 		if (!(DISPLAY_STAT & (_BV(DISBSY) | _BV(DISUPD)))) {
-			if (bit_is_clear(PINC, RTCINT)) {
-				read_rtc();
+			if (bit_is_clear(PINC, RTCINT) && !rtcwait) {
+				sync_rtc();
+			}
+			if (newminute) {
+				newminute = 0;
+				show_time();
+			}
+			while (evtri != evtwi
+			       && bit_is_clear(DISPLAY_STAT, DISUPD)) {
+				read_event();
 			}
 			while (BUFRI != BUFWI
 			       && bit_is_clear(DISPLAY_STAT, DISUPD)) {
 				read_queue();
 			}
 		}
+		if (ds3231_xfers != xm) {
+			xfer_event = (uint8_t) (ds3231_xfers - xm);
+			xm = ds3231_xfers;
+		}
 	} while (1);
 }
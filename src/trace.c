@@ -0,0 +1,100 @@
+// SPDX-License-Identifier: MIT
+
+/*
+ * Capture of latched display requests for sweep timing analysis
+ *
+ * Each latch is reduced to the set of columns with a powered coil
+ * and a coil count, stamped with the system tick and timer count.
+ * Capture stops when the ring is full, so a whole sweep started
+ * after trace_enable() is kept intact until it is read out.
+ *
+ * Requests are latched from the Timer0 interrupt, which only writes
+ * trace_wi and the latency range. The main loop only writes trace_ri.
+ */
+
+#include "hal.h"
+#include "util.h"
+#include "trace.h"
+
+struct trace_entry trace[TRACE_LEN];
+uint8_t trace_on;
+uint8_t trace_wi;
+uint8_t trace_ri;
+uint8_t trace_minlat = 0xffU;
+uint8_t trace_maxlat;
+
+void trace_enable(uint8_t on)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		trace_on = on;
+		trace_wi = 0U;
+		trace_ri = 0U;
+		trace_minlat = 0xffU;
+		trace_maxlat = 0U;
+	}
+}
+
+void trace_latch(uint8_t * req)
+{
+	struct trace_entry *e;
+	uint8_t look = (uint8_t) ((trace_wi + 1U) & TRACE_MASK);
+	uint8_t panel = 0U;
+	uint8_t line;
+	uint8_t pairs;
+	uint8_t col;
+	uint8_t count = hal_timer_count();
+
+	if (count < trace_minlat) {
+		trace_minlat = count;
+	}
+	if (count > trace_maxlat) {
+		trace_maxlat = count;
+	}
+	if (!trace_on || look == trace_ri) {
+		return;
+	}
+	e = &trace[trace_wi];
+	e->tick = SYSTICK;
+	e->count = count;
+	e->coils = 0U;
+	line = 0U;
+	do {
+		e->cols[line] = 0U;
+		line++;
+	} while (line < DISPLAY_GROUPS);
+
+	/* request is shifted out from the last panel, see display.h */
+	do {
+		line = 0U;
+		do {
+			pairs = *req++;
+			col = (uint8_t) ((DISPLAY_PANELS - 1U - panel)
+					 * PANEL_COLS);
+			while (pairs) {
+				if (pairs & 0x3U) {
+					e->cols[col >> 3] |=
+					    (uint8_t) (1U << (col & 0x7U));
+					e->coils++;
+				}
+				pairs = pairs >> 2;
+				col++;
+			}
+			line++;
+		} while (line < DISPLAY_LINES);
+		panel++;
+	} while (panel < DISPLAY_PANELS);
+	barrier();
+	trace_wi = look;
+}
+
+uint8_t trace_read(struct trace_entry *e)
+{
+	barrier();
+	if (trace_ri == trace_wi) {
+		return 0U;
+	}
+	*e = trace[trace_ri];
+	barrier();
+	trace_ri = (uint8_t) ((trace_ri + 1U) & TRACE_MASK);
+	return 1U;
+}
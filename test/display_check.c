@@ -0,0 +1,493 @@
+// SPDX-License-Identifier: MIT
+
+/*
+ * Display kernel check and benchmark
+ *
+ * Usage: display_check [font.xbm]
+ *
+ * Built natively once per DISPLAY_PANELS value by make check. The
+ * request encoding, glyph rendering and raw column drawing of
+ * src/display.c are compared against a pixel-level reference model
+ * built only from the panel message format in include/display.h
+ * and the font bitmap in include/5x4_ascii.xbm. Random frames are
+ * then swept through display_tick() and display_step() and every
+ * latched request is applied to a model of the panels, which must
+ * end up showing the frame. Finally each kernel is timed and
+ * reported in operations per second.
+ */
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "hal.h"
+#include "display.h"
+
+#define CHECK_FONT	"include/5x4_ascii.xbm"
+#define CHECK_GLYPHS	64	/* characters 0x20-0x5f */
+#define CHECK_FRAMES	2000
+#define CHECK_BENCH_NS	200000000L	/* time per benchmark */
+#define CHECK_HIST	1024	/* step timing buckets of 8 ns */
+
+/* Registers used directly by the firmware */
+volatile uint8_t GPIOR0;
+volatile uint8_t GPIOR1;
+volatile uint8_t GPIOR2;
+volatile uint8_t OCR0B;
+volatile uint8_t UCSR0A;
+volatile uint8_t UDR0;
+volatile uint8_t PIND;
+volatile uint8_t PORTD;
+volatile uint8_t PINC;
+
+/* display.c internals under test, not exported by display.h */
+uint8_t req_offset(uint8_t group, uint8_t panel, uint8_t line);
+void update_column(uint8_t col);
+void display_invalidate(void);
+
+/* panel shift register, latched pixels and coil action counts */
+uint8_t sr[DISPLAY_REQLEN];
+uint8_t panel[DISPLAY_COLS][DISPLAY_LINES];
+unsigned long latches;
+int modelled = 1;		/* apply latches to the panel model */
+
+/* display_step timing from the tick, see run_update */
+struct timespec tick_at;
+int stepping;
+unsigned shifted;		/* bytes shifted out since the tick */
+unsigned long latch_hist[CHECK_HIST];
+unsigned long step_hist[CHECK_HIST];
+
+/* font bitmap, one byte per row as stored in the xbm */
+uint8_t xbm[CHECK_GLYPHS / 2 * DISPLAY_LINES];
+
+unsigned long failures;
+
+/* ---- reference model of include/display.h ---- */
+
+/*
+ * Request byte holding row (0 = top) of the panel counted from the
+ * left: panel messages are shifted out last panel first, each from
+ * its bottom row (pixels 17-20) to its top row (pixels 1-4).
+ */
+unsigned ref_byte(unsigned p, unsigned row)
+{
+	return (DISPLAY_PANELS - 1U - p) * DISPLAY_LINES
+	    + (DISPLAY_LINES - 1U - row);
+}
+
+/* Bit of the set coil for column c (0 = left) of a panel, the clear
+ * coil is the next bit up */
+unsigned ref_setbit(unsigned c)
+{
+	unsigned pixel = PANEL_COLS - c;	/* 1-4 from the right */
+	return 6U - 2U * (pixel - 1U);
+}
+
+/* Pixel of glyph ch at x (0 = left), y (0 = top) from the font */
+unsigned ref_glyph(uint8_t ch, unsigned x, unsigned y)
+{
+	unsigned idx;
+	if (ch < 0x20 || ch >= 0x80)
+		return 0;
+	if (ch >= 0x60)
+		ch = (uint8_t) (ch - 0x20);	/* lower case shown as upper */
+	idx = ch - 0x20U;
+	return (xbm[(idx % 32U) * DISPLAY_LINES + y]
+		>> ((idx / 32U) * PANEL_COLS + x)) & 1U;
+}
+
+/* Apply coil actions of the shift register to the panel model */
+void ref_latch(void)
+{
+	unsigned col;
+	unsigned row;
+	unsigned pair;
+	for (col = 0; col < DISPLAY_COLS; col++) {
+		for (row = 0; row < DISPLAY_LINES; row++) {
+			pair = (unsigned) sr[ref_byte(col / PANEL_COLS, row)]
+			    >> ref_setbit(col % PANEL_COLS);
+			if ((pair & 3U) == 3U) {
+				printf("col %u row %u: set and clear\n",
+				       col, row);
+				failures++;
+			} else if (pair & 1U) {
+				panel[col][row] = 1;
+			} else if (pair & 2U) {
+				panel[col][row] = 0;
+			}
+		}
+	}
+}
+
+/* Pixel of a buffer column at row (0 = top) */
+unsigned buf_pixel(uint8_t val, unsigned row)
+{
+	return (val >> (DISPLAY_LINES - 1U - row)) & 1U;
+}
+
+/* ---- hal substitutes ---- */
+
+/* report a result that disagrees with the model */
+void fail(const char *what, unsigned a, unsigned b)
+{
+	if (failures < 20)
+		printf("%s: %u %u\n", what, a, b);
+	failures++;
+}
+
+long elapsed_ns(struct timespec *t0)
+{
+	struct timespec t1;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return (t1.tv_sec - t0->tv_sec) * 1000000000L
+	    + (t1.tv_nsec - t0->tv_nsec);
+}
+
+/* count time since t0, the last bucket holds everything longer */
+void sample(unsigned long *hist, struct timespec *t0)
+{
+	long bucket = elapsed_ns(t0) / 8L;
+	if (bucket >= CHECK_HIST)
+		bucket = CHECK_HIST - 1;
+	hist[bucket]++;
+}
+
+/* time below which pct percent of samples fall */
+long percentile(unsigned long *hist, unsigned long pct)
+{
+	unsigned long total = 0;
+	unsigned long sum = 0;
+	long bucket;
+	for (bucket = 0; bucket < CHECK_HIST; bucket++)
+		total += hist[bucket];
+	for (bucket = 0; bucket < CHECK_HIST - 1; bucket++) {
+		sum += hist[bucket];
+		if (sum * 100U >= total * pct)
+			break;
+	}
+	return (bucket + 1) * 8L;
+}
+
+void hal_spi_init(void)
+{
+}
+
+void hal_spi_send(uint8_t val)
+{
+	memmove(&sr[0], &sr[1], DISPLAY_REQLEN - 1);
+	sr[DISPLAY_REQLEN - 1] = val;
+	shifted++;
+}
+
+void hal_spi_latch(void)
+{
+	if (stepping) {
+		/* the tick must latch what was shifted out a tick ago */
+		sample(latch_hist, &tick_at);
+		if (shifted)
+			fail("latch after shift", shifted, 0);
+	}
+	if (modelled) {
+		latches++;
+		ref_latch();
+	}
+}
+
+uint8_t hal_timer_count(void)
+{
+	return 0U;
+}
+
+/* ---- checks ---- */
+
+uint8_t random_col(void)
+{
+	return (uint8_t) ((unsigned) rand() & DISPLAY_COLMASK);
+}
+
+void check_req_offset(void)
+{
+	unsigned col;
+	unsigned row;
+	for (col = 0; col < DISPLAY_COLS; col++) {
+		for (row = 0; row < DISPLAY_LINES; row++) {
+			if (req_offset((uint8_t) (col >> 3),
+				       (uint8_t) ((col >> 2) & 1U),
+				       (uint8_t) row)
+			    != ref_byte(col / PANEL_COLS, row))
+				fail("req_offset", col, row);
+		}
+	}
+}
+
+void check_update_column(void)
+{
+	uint8_t req[DISPLAY_REQLEN];
+	unsigned col;
+	unsigned row;
+	unsigned pair;
+	unsigned want;
+	uint8_t was;
+	unsigned n;
+	for (n = 0; n < CHECK_FRAMES; n++) {
+		memset(display.req, 0, sizeof(display.req));
+		col = (unsigned) rand() % DISPLAY_COLS;
+		display.buf[col] = random_col();
+		display.cur[col] = random_col();
+		was = display.cur[col];
+		update_column((uint8_t) col);
+		memcpy(req, display.req, sizeof(req));
+		if (display.cur[col] != display.buf[col])
+			fail("update_column cur", col, display.cur[col]);
+		for (row = 0; row < DISPLAY_LINES; row++) {
+			pair = (unsigned) req[ref_byte(col / PANEL_COLS, row)]
+			    >> ref_setbit(col % PANEL_COLS);
+			want = 0;
+			if (buf_pixel(display.buf[col], row)
+			    != buf_pixel(was, row))
+				want = buf_pixel(display.buf[col], row) ? 1U : 2U;
+			if ((pair & 3U) != want)
+				fail("update_column coil", col, row);
+			/* clear the pair, nothing else may be driven */
+			req[ref_byte(col / PANEL_COLS, row)] &=
+			    (uint8_t) ~ (3U << ref_setbit(col % PANEL_COLS));
+		}
+		for (row = 0; row < DISPLAY_REQLEN; row++) {
+			if (req[row])
+				fail("update_column stray", col, row);
+		}
+	}
+}
+
+void check_draw(void)
+{
+	uint8_t want[DISPLAY_BUFLEN];
+	unsigned col;
+	unsigned x;
+	unsigned y;
+	uint8_t ch;
+	uint8_t data;
+	unsigned n;
+	for (n = 0; n < CHECK_FRAMES; n++) {
+		display_select(DISPLAY_BACKGROUND);
+		for (col = 0; col < DISPLAY_BUFLEN; col++)
+			want[col] = display.draw[col] = random_col();
+		col = (unsigned) rand() % (DISPLAY_COLS + 4U);
+		if (n < 0x200U) {
+			/* first pass: every glyph in full on a blank buffer */
+			memset(want, 0, sizeof(want));
+			memset(display.draw, 0, DISPLAY_BUFLEN);
+			col = 0;
+		}
+		if (n & 1U) {
+			ch = (uint8_t) (n >> 1);	/* every byte value */
+			display_char(ch, (uint8_t) col);
+			for (x = 0; x < PANEL_COLS; x++) {
+				for (y = 0; col + x < DISPLAY_COLS
+				     && y < DISPLAY_LINES; y++) {
+					if (ref_glyph(ch, x, y))
+						want[col + x] |= (uint8_t)
+						    (1U << (DISPLAY_LINES - 1U - y));
+				}
+			}
+		} else {
+			data = (uint8_t) rand();
+			display_data(data, (uint8_t) col);
+			if (col < DISPLAY_COLS)
+				want[col] |= data & DISPLAY_COLMASK;
+		}
+		for (x = 0; x < DISPLAY_BUFLEN; x++) {
+			if (display.draw[x] != want[x])
+				fail(n & 1U ? "display_char" : "display_data",
+				     col, x);
+		}
+	}
+}
+
+/* run one display update to completion */
+void run_update(void)
+{
+	unsigned ticks = 0;
+	display_trigger();
+	do {
+		display_tick();
+		shifted = 0;
+		stepping = 1;
+		clock_gettime(CLOCK_MONOTONIC, &tick_at);
+		display_step();
+		sample(step_hist, &tick_at);
+		stepping = 0;
+		ticks++;
+	} while (bit_is_clear(DISPLAY_STAT, DISDONE) && ticks < 1000U);
+	DISPLAY_STAT &= (uint8_t) ~ _BV(DISDONE);
+}
+
+/* a completed update must survive the start of the next one */
+void check_done_kept(void)
+{
+	unsigned ticks = 0;
+	DISPLAY_STAT = _BV(DISDONE);
+	display_select(DISPLAY_BACKGROUND);
+	display.draw[0] ^= 0x1fU;
+	display_trigger();
+	display_tick();
+	if (bit_is_clear(DISPLAY_STAT, DISDONE))
+		fail("DISDONE lost at sweep start", 0, 0);
+	while (bit_is_set(DISPLAY_STAT, DISBSY) && ticks++ < 1000U)
+		display_step();
+	DISPLAY_STAT = 0U;
+}
+
+void check_sweep(void)
+{
+	unsigned col;
+	unsigned row;
+	unsigned n;
+
+	/* start from a blank display known to the firmware */
+	memset(display.buf, 0, sizeof(display.buf));
+	memset(display.cur, 0, sizeof(display.cur));
+	memset(display.req, 0, sizeof(display.req));
+	memset(panel, 0, sizeof(panel));
+	for (n = 0; n < CHECK_FRAMES; n++) {
+		display_select(DISPLAY_BACKGROUND);
+		for (col = 0; col < DISPLAY_COLS; col++)
+			display.draw[col] = random_col();
+		display_order((uint8_t) (rand() % DISPLAY_ORDERS));
+		display_effect((uint8_t) (rand() % DISPLAY_EFFECTS));
+		display_power((uint8_t) (rand() % (DISPLAY_COLS + 1)));
+		if (rand() % 8 == 0)
+			display_flush();
+		run_update();
+		for (col = 0; col < DISPLAY_COLS; col++) {
+			for (row = 0; row < DISPLAY_LINES; row++) {
+				if (panel[col][row] !=
+				    buf_pixel(display.draw[col], row))
+					fail("sweep panel", col, row);
+			}
+		}
+		for (row = 0; row < DISPLAY_REQLEN; row++) {
+			if (sr[row])
+				fail("sweep not relaxed", n, row);
+		}
+	}
+}
+
+/* ---- benchmarks ---- */
+
+void report(const char *name, unsigned long ops, long ns)
+{
+	printf("  %-18s %10.0f ops/s\n", name, (double) ops * 1e9 / (double) ns);
+}
+
+void bench(void)
+{
+	struct timespec t0;
+	unsigned long ops;
+	unsigned col;
+	long ns;
+
+	modelled = 0;
+	ops = 0;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	do {
+		for (col = 0; col < DISPLAY_COLS; col++) {
+			display.cur[col] = (uint8_t) ~ display.buf[col];
+			update_column((uint8_t) col);
+		}
+		ops += DISPLAY_COLS;
+	} while ((ns = elapsed_ns(&t0)) < CHECK_BENCH_NS);
+	report("update_column", ops, ns);
+
+	ops = 0;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	do {
+		for (col = 0; col < DISPLAY_COLS; col++)
+			display_data((uint8_t) ops, (uint8_t) col);
+		ops += DISPLAY_COLS;
+	} while ((ns = elapsed_ns(&t0)) < CHECK_BENCH_NS);
+	report("display_data", ops, ns);
+
+	ops = 0;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	do {
+		for (col = 0; col < DISPLAY_COLS; col += PANEL_COLS)
+			display_char((uint8_t) (0x20U + (ops & 0x3fU)),
+				     (uint8_t) col);
+		ops += DISPLAY_PANELS;
+	} while ((ns = elapsed_ns(&t0)) < CHECK_BENCH_NS);
+	report("display_char", ops, ns);
+
+	ops = 0;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	do {
+		display_invalidate();
+		ops++;
+	} while ((ns = elapsed_ns(&t0)) < CHECK_BENCH_NS);
+	report("display_invalidate", ops, ns);
+
+	ops = 0;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	do {
+		display_fill((uint8_t) ops);
+		ops++;
+	} while ((ns = elapsed_ns(&t0)) < CHECK_BENCH_NS);
+	report("display_fill", ops, ns);
+
+	ops = 0;
+	memset(latch_hist, 0, sizeof(latch_hist));
+	memset(step_hist, 0, sizeof(step_hist));
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	do {
+		display_select(DISPLAY_BACKGROUND);
+		display.draw[ops % DISPLAY_COLS] ^= 0x1fU;
+		run_update();
+		ops++;
+	} while ((ns = elapsed_ns(&t0)) < CHECK_BENCH_NS);
+	report("sweep (1 column)", ops, ns);
+	printf("  %-18s %10ld ns median, %ld ns 99th percentile\n",
+	       "tick to latch", percentile(latch_hist, 50U),
+	       percentile(latch_hist, 99U));
+	printf("  %-18s %10ld ns median, %ld ns 99th percentile\n",
+	       "whole step", percentile(step_hist, 50U),
+	       percentile(step_hist, 99U));
+}
+
+int main(int argc, char **argv)
+{
+	const char *path = argc > 1 ? argv[1] : CHECK_FONT;
+	FILE *fp = fopen(path, "r");
+	unsigned val;
+	size_t n = 0;
+	int c;
+
+	if (fp == NULL) {
+		perror(path);
+		return 2;
+	}
+	while ((c = fgetc(fp)) != EOF && c != '{') ;
+	while (n < sizeof(xbm) && (c = fgetc(fp)) != EOF) {
+		if (c == 'x' && fscanf(fp, "%2x", &val) == 1)
+			xbm[n++] = (uint8_t) val;
+	}
+	fclose(fp);
+	if (n < sizeof(xbm)) {
+		fprintf(stderr, "%s: short font\n", path);
+		return 2;
+	}
+
+	srand(1);
+	display_init();
+	check_req_offset();
+	check_update_column();
+	check_draw();
+	check_sweep();
+	check_done_kept();
+	printf("DISPLAY_PANELS=%d: %lu latches checked, %lu failures\n",
+	       DISPLAY_PANELS, latches, failures);
+	if (failures)
+		return 1;
+	bench();
+	return 0;
+}